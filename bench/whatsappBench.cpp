@@ -0,0 +1,537 @@
+/**
+ * Microbenchmarks of the servers hot functions. The server is compiled into this program with
+ * WHATSAPP_SERVER_NO_MAIN so the functions run exactly as they do in the server, against
+ * socketpairs instead of real clients. The results are written as JSON, to the file given as
+ * the first argument or to stdout.
+ */
+#include "whatsappServer.cpp"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <malloc.h>
+#include <netinet/tcp.h>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+/**
+ * The minimal time every benchmark runs for.
+ */
+const std::chrono::nanoseconds MIN_DURATION = std::chrono::milliseconds(300);
+
+/**
+ * The result of a single benchmark.
+ */
+struct BenchResult
+{
+    std::string name;
+    uint64_t iterations;
+    double ns_per_op;
+    /** The heap memory per operation, for the benchmarks that measure it, -1 otherwise. */
+    double bytes_per_op;
+};
+
+std::vector<BenchResult> results;
+
+/**
+ * Keeps the compiler from optimizing away a value that is computed only to be measured.
+ */
+template <typename T>
+void keep(const T &value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+/**
+ * Runs a benchmark whose body measures its own time, doubling the iterations until the measured
+ * time reaches MIN_DURATION.
+ * @param name The benchmarks name in the results.
+ * @param body Runs one iteration and returns the nanoseconds spent in the measured part.
+ */
+template <typename Body>
+void run_timed(const std::string &name, Body body)
+{
+    for (int i = 0; i < 100; ++i)
+    {
+        body();
+    }
+    uint64_t iterations = 1;
+    while (true)
+    {
+        uint64_t elapsed = 0;
+        for (uint64_t i = 0; i < iterations; ++i)
+        {
+            elapsed += body();
+        }
+        if (std::chrono::nanoseconds(elapsed) >= MIN_DURATION || iterations >= (1ULL << 30))
+        {
+            results.push_back({name, iterations, (double)elapsed / (double)iterations, -1});
+            return;
+        }
+        iterations *= 2;
+    }
+}
+
+/**
+ * Runs a benchmark whose whole body is measured.
+ * @param name The benchmarks name in the results.
+ * @param body Runs one iteration.
+ */
+template <typename Body>
+void run(const std::string &name, Body body)
+{
+    run_timed(name, [&body]()
+    {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    });
+}
+
+/**
+ * Connects a registered client through a socketpair.
+ * @param name The clients name.
+ * @param peer Set to the other end of the socketpair, the one the client would read from.
+ * @return The clients fd on the server side.
+ */
+int add_client(const std::string &name, int &peer)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) < 0)
+    {
+        std::cerr<<"ERROR: socketpair "<<errno<<"."<<std::endl;
+        exit(1);
+    }
+    open_connection(pair[0]);
+    register_client(pair[0], name);
+    peer = pair[1];
+    return pair[0];
+}
+
+/**
+ * Reads and drops everything a client was sent.
+ * @param peer The clients end of the socketpair.
+ */
+void drain(int peer)
+{
+    static char buf[65536];
+    while (read(peer, buf, sizeof(buf)) > 0)
+    {
+    }
+}
+
+/**
+ * Disconnects every client and drops all the groups.
+ */
+void reset_server(std::vector<int> &peers)
+{
+    std::vector<int> fds = connected_fds;
+    for (int fd : fds)
+    {
+        client_exit_request(fd, false);
+    }
+    for (int peer : peers)
+    {
+        close(peer);
+    }
+    peers.clear();
+    group_to_clients.clear();
+}
+
+void bench_split()
+{
+    std::string message("send team1 hello there this is a fairly typical group message");
+    run("split", [&]()
+    {
+        std::deque<std::string> words = split(message, " ");
+        keep(words);
+    });
+}
+
+void bench_legal_name()
+{
+    std::vector<int> peers;
+    for (int i = 0; i < 1000; ++i)
+    {
+        int peer;
+        int fd = add_client("client" + std::to_string(i), peer);
+        peers.push_back(peer);
+        if (i % 10 == 0)
+        {
+            Membership members;
+            members.insert(fd);
+            group_to_clients["group" + std::to_string(i)] = members;
+        }
+    }
+    std::string name("newClientName42");
+    run("legal_name", [&]()
+    {
+        bool legal = legal_name(name);
+        keep(legal);
+    });
+    reset_server(peers);
+}
+
+void bench_write_wrapper()
+{
+    int peer;
+    int fd = add_client("writer", peer);
+    std::vector<int> peers(1, peer);
+    std::string message(64, 'm');
+    uint64_t count = 0;
+    run("write_wrapper_64B", [&]()
+    {
+        write_wrapper(fd, message);
+        if (++count % 256 == 0)
+        {
+            drain(peers[0]);
+        }
+    });
+    reset_server(peers);
+}
+
+void bench_who_request()
+{
+    std::vector<int> peers;
+    for (int i = 0; i < 1000; ++i)
+    {
+        int peer;
+        add_client("client" + std::to_string(i), peer);
+        peers.push_back(peer);
+    }
+    int requester = *name_to_fd.find("client0");
+    run("who_request_1000_clients", [&]()
+    {
+        whatsapp::spawn(who_request(requester));
+        drain(peers[0]);
+    });
+    reset_server(peers);
+}
+
+void bench_client_exit_request()
+{
+    std::vector<int> peers;
+    std::vector<int> members;
+    for (int i = 0; i < 500; ++i)
+    {
+        int peer;
+        members.push_back(add_client("client" + std::to_string(i), peer));
+        peers.push_back(peer);
+    }
+    for (int group = 0; group < 100; ++group)
+    {
+        Membership membership;
+        for (int i = 0; i < 50; ++i)
+        {
+            membership.insert(members[(group * 7 + i) % members.size()]);
+        }
+        group_to_clients["group" + std::to_string(group)] = membership;
+    }
+    run_timed("client_exit_request_100_groups", [&]()
+    {
+        int peer;
+        int fd = add_client("leaving", peer);
+        for (int group = 0; group < 100; group += 10)
+        {
+            group_to_clients["group" + std::to_string(group)].insert(fd);
+        }
+        auto start = std::chrono::steady_clock::now();
+        client_exit_request(fd, false);
+        uint64_t elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        close(peer);
+        return elapsed;
+    });
+    reset_server(peers);
+}
+
+void bench_group_fan_out(int members_count)
+{
+    std::vector<int> peers;
+    Membership members;
+    for (int i = 0; i < members_count; ++i)
+    {
+        int peer;
+        members.insert(add_client("member" + std::to_string(i), peer));
+        peers.push_back(peer);
+    }
+    group_to_clients["team"] = members;
+    int sender = *name_to_fd.find("member0");
+    std::string message("hello team, this is a group message");
+    uint64_t count = 0;
+    run_timed("group_fan_out_" + std::to_string(members_count) + "_members", [&]()
+    {
+        auto start = std::chrono::steady_clock::now();
+        whatsapp::spawn(send_group_message_request(sender, "team", group_to_clients["team"],
+                                                   message));
+        uint64_t elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        // The socket buffers hold a few hundred messages, drain them before any fills up.
+        if (++count % 256 == 0)
+        {
+            for (int peer : peers)
+            {
+                drain(peer);
+            }
+        }
+        return elapsed;
+    });
+    reset_server(peers);
+}
+
+void bench_publish_fan_out(int subscribers_count)
+{
+    std::vector<int> peers;
+    const char *patterns[] = {"news.*", "news.#", "*.eu", "news.eu"};
+    for (int i = 0; i < subscribers_count; ++i)
+    {
+        int peer;
+        int fd = add_client("subscriber" + std::to_string(i), peer);
+        topics.subscribe(patterns[i % 4], fd);
+        fd_to_patterns[fd].push_back(patterns[i % 4]);
+        peers.push_back(peer);
+    }
+    int sender = *name_to_fd.find("subscriber0");
+    std::string message("hello subscribers, this is a published message");
+    uint64_t count = 0;
+    run_timed("publish_fan_out_" + std::to_string(subscribers_count) + "_subscribers", [&]()
+    {
+        auto start = std::chrono::steady_clock::now();
+        whatsapp::spawn(publish_request(sender, "news.eu", message));
+        uint64_t elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        if (++count % 256 == 0)
+        {
+            for (int peer : peers)
+            {
+                drain(peer);
+            }
+        }
+        return elapsed;
+    });
+    reset_server(peers);
+}
+
+/**
+ * Registers idle clients through the full request path, a create_client request that is read,
+ * handled and answered, and measures the heap they keep once they are idle.
+ * @param clients_count The number of clients.
+ */
+void bench_idle_clients(int clients_count)
+{
+    std::vector<int> peers;
+    std::vector<int> fds;
+    for (int i = 0; i < clients_count; ++i)
+    {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) < 0)
+        {
+            std::cerr<<"ERROR: socketpair "<<errno<<"."<<std::endl;
+            exit(1);
+        }
+        fds.push_back(pair[0]);
+        peers.push_back(pair[1]);
+    }
+    // The table is sized up front so it is counted like the rest of the per client state.
+    connections.reserve((size_t)*std::max_element(fds.begin(), fds.end()) + 1);
+    connected_fds.reserve(fds.size());
+    size_t heap_before = mallinfo2().uordblks;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < clients_count; ++i)
+    {
+        std::string request = "create_client idleClient" + std::to_string(i);
+        std::string length = std::to_string(request.size());
+        request = std::string(4 - length.size(), '0') + length + request;
+        write(peers[i], request.data(), request.size());
+        open_connection(fds[i]);
+        read_connection(fds[i]);
+        drain(peers[i]);
+    }
+    uint64_t elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    size_t heap_after = mallinfo2().uordblks;
+    // The table was reserved before, each client is counted one slot of it. Every other slot
+    // belongs to a peer end of the socketpairs.
+    results.push_back({"idle_client_" + std::to_string(clients_count) + "_clients",
+                       (uint64_t)clients_count, (double)elapsed / clients_count,
+                       (double)(heap_after - heap_before) / clients_count + sizeof(Connection)});
+    reset_server(peers);
+}
+
+void bench_accept_batch()
+{
+    std::string path = "/tmp/whatsappBench-" + std::to_string(getpid()) + ".sock";
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    unlink(path.c_str());
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listener, ACCEPT_BATCH) < 0)
+    {
+        std::cerr<<"ERROR: listen "<<errno<<"."<<std::endl;
+        exit(1);
+    }
+    std::vector<int> peers;
+    run_timed("accept_batch_" + std::to_string(ACCEPT_BATCH), [&]()
+    {
+        for (int i = 0; i < ACCEPT_BATCH; ++i)
+        {
+            int peer = socket(AF_UNIX, SOCK_STREAM, 0);
+            connect(peer, (struct sockaddr *)&addr, sizeof(addr));
+            peers.push_back(peer);
+        }
+        auto start = std::chrono::steady_clock::now();
+        accept_connections(listener, false);
+        uint64_t elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        reset_server(peers);
+        return elapsed;
+    });
+    close(listener);
+    unlink(path.c_str());
+}
+
+/**
+ * Sends a 64 byte request and waits for the reply on a blocking socket, with the peer echoing
+ * from another thread, as a client and the server do.
+ * @param name The benchmarks name in the results.
+ * @param fd The clients end.
+ * @param peer The servers end, closed when the benchmark is done.
+ */
+void bench_round_trip(const std::string &name, int fd, int peer)
+{
+    const size_t FRAME_SIZE = 68;
+    std::thread echo([peer, FRAME_SIZE]()
+    {
+        char frame[FRAME_SIZE];
+        while (recv(peer, frame, FRAME_SIZE, MSG_WAITALL) == (ssize_t)FRAME_SIZE &&
+               write(peer, frame, FRAME_SIZE) == (ssize_t)FRAME_SIZE)
+        {
+        }
+    });
+    std::string request = "0064" + std::string(64, 'r');
+    char reply[FRAME_SIZE];
+    run(name, [&]()
+    {
+        write(fd, request.data(), FRAME_SIZE);
+        recv(fd, reply, FRAME_SIZE, MSG_WAITALL);
+    });
+    shutdown(fd, SHUT_RDWR);
+    echo.join();
+    close(fd);
+    close(peer);
+}
+
+/**
+ * Compares a round trip over the local (unix domain) transport with one over loopback TCP.
+ */
+void bench_transports()
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+    {
+        std::cerr<<"ERROR: socketpair "<<errno<<"."<<std::endl;
+        exit(1);
+    }
+    bench_round_trip("round_trip_unix", pair[0], pair[1]);
+
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int peer = -1;
+    if (listener < 0 || fd < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listener, 1) < 0 || getsockname(listener, (struct sockaddr *)&addr, &length) < 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        (peer = accept(listener, NULL, NULL)) < 0)
+    {
+        std::cerr<<"ERROR: loopback "<<errno<<"."<<std::endl;
+        exit(1);
+    }
+    close(listener);
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    bench_round_trip("round_trip_tcp_loopback", fd, peer);
+}
+
+/**
+ * A stream buffer that drops everything written to it.
+ */
+struct NullBuffer : std::streambuf
+{
+    int overflow(int c) override
+    {
+        return c;
+    }
+};
+
+/**
+ * @return The results as a JSON document.
+ */
+std::string results_json()
+{
+    std::ostringstream json;
+    json << "{\n  \"compiler\": \"" << __VERSION__ << "\",\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        json << "    {\"name\": \"" << results[i].name << "\", \"iterations\": "
+             << results[i].iterations << ", \"ns_per_op\": " << results[i].ns_per_op;
+        if (results[i].bytes_per_op >= 0)
+        {
+            json << ", \"bytes_per_op\": " << results[i].bytes_per_op;
+        }
+        json << "}"
+             << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ]\n}\n";
+    return json.str();
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2)
+    {
+        std::cerr << "USAGE: whatsappBench [resultsFile]" << std::endl;
+        exit(1);
+    }
+    // The fan-out benchmarks need a few thousand socketpairs.
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    signal(SIGPIPE, SIG_IGN);
+
+    // The handlers log every request, which would be measured too.
+    NullBuffer null_buffer;
+    std::streambuf *cout_buffer = std::cout.rdbuf(&null_buffer);
+
+    bench_split();
+    bench_transports();
+    bench_legal_name();
+    bench_write_wrapper();
+    bench_who_request();
+    bench_client_exit_request();
+    bench_group_fan_out(16);
+    bench_group_fan_out(1000);
+    bench_publish_fan_out(1000);
+    bench_accept_batch();
+    bench_idle_clients(5000);
+
+    std::cout.rdbuf(cout_buffer);
+    std::string json = results_json();
+    if (argc == 2)
+    {
+        std::ofstream(argv[1]) << json;
+    }
+    std::cout << json;
+    return 0;
+}
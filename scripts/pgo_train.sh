@@ -0,0 +1,62 @@
+#!/bin/bash
+# Trains the PGO profiles: runs an instrumented server and a scripted set of instrumented clients
+# that register, create and change groups, send direct and group messages and exit.
+# usage: pgo_train.sh serverBinary clientBinary profileDir [clients] [rounds]
+set -e
+
+server=$1
+client=$2
+profile_dir=$3
+clients=${4:-16}
+rounds=${5:-200}
+port=$((20000 + RANDOM % 20000))
+
+if [ -z "$server" ] || [ -z "$client" ] || [ -z "$profile_dir" ]; then
+    echo "usage: pgo_train.sh serverBinary clientBinary profileDir [clients] [rounds]" >&2
+    exit 1
+fi
+
+mkdir -p "$profile_dir"
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+mkfifo "$work/server_in"
+
+"$server" "$port" < "$work/server_in" > /dev/null 2>&1 &
+server_pid=$!
+exec 3> "$work/server_in"
+sleep 0.5
+
+client_pids=()
+for i in $(seq 1 "$clients"); do
+    (
+        # Let every client register before the groups are created.
+        sleep 0.5
+        echo "create_group team$i bot$((i % clients + 1)),bot$(((i + 1) % clients + 1))"
+        for r in $(seq 1 "$rounds"); do
+            echo "send bot$(((i + r) % clients + 1)) hello number $r from bot$i"
+            echo "send team$i group message number $r"
+            if [ $((r % 20)) -eq 0 ]; then
+                echo "who"
+                echo "leave team$i"
+                echo "join team$i"
+            fi
+        done
+        sleep 1
+        echo "exit"
+        sleep 1
+    ) | "$client" "bot$i" 127.0.0.1 "$port" > /dev/null 2>&1 &
+    client_pids+=($!)
+done
+
+for pid in "${client_pids[@]}"; do
+    wait "$pid" || true
+done
+echo "EXIT" >&3
+exec 3>&-
+wait "$server_pid" || true
+
+# Clang writes raw profiles that have to be merged, GCC writes the .gcda files directly.
+if ls "$profile_dir"/*.profraw > /dev/null 2>&1; then
+    llvm-profdata merge -o "$profile_dir/default.profdata" "$profile_dir"/*.profraw
+fi
+echo "PGO profiles written to $profile_dir"
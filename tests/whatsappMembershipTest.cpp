@@ -0,0 +1,105 @@
+/**
+ * Tests of the group membership. The server is compiled into this program with
+ * WHATSAPP_SERVER_NO_MAIN, like the microbenchmarks. Membership is checked against a std::set
+ * with random operations, and a dense and a sparse group are checked to take the right
+ * representation. Prints the failed checks and exits with 1 if there are any.
+ */
+#include "whatsappServer.cpp"
+
+#include <random>
+#include <set>
+
+/**
+ * The number of failed checks.
+ */
+int failures = 0;
+
+/**
+ * Records a check.
+ * @param ok The checks result.
+ * @param what What was checked, printed if it failed.
+ */
+void check(bool ok, const std::string &what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAIL: " << what << std::endl;
+        failures++;
+    }
+}
+
+/**
+ * Random inserts and erases against a set, over fd ranges that keep a group a vector, switch it
+ * to a bitmap and back.
+ */
+void test_membership_random()
+{
+    std::mt19937 random(2);
+    for (int round = 0; round < 200; ++round)
+    {
+        Membership group;
+        std::set<int> model;
+        int range = 1 + random() % 5000;
+        for (int i = 0; i < 3000; ++i)
+        {
+            int member = random() % range;
+            if (random() % 3 != 0)
+            {
+                check(group.insert(member) == model.insert(member).second, "insert");
+            }
+            else
+            {
+                check(group.erase(member) == (model.erase(member) == 1), "erase");
+            }
+        }
+        check(group.size() == model.size(), "size");
+        std::vector<int> members;
+        group.for_each([&members](int member) { members.push_back(member); });
+        check(members == std::vector<int>(model.begin(), model.end()), "members in order");
+        for (int member = 0; member < range; ++member)
+        {
+            check(group.contains(member) == (model.count(member) == 1), "contains");
+        }
+        if (failures > 0)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * A dense group takes the bitmap, a sparse one stays a vector however many members it has.
+ */
+void test_membership_switch()
+{
+    Membership dense;
+    for (int member = 0; member < 1000; ++member)
+    {
+        dense.insert(member);
+    }
+    check(dense.memory() < 1000 * sizeof(int), "a dense group is a bitmap");
+    dense.insert(1000000);
+    check(dense.memory() < 4 * 1001 * sizeof(int), "a far member turns it back to a vector");
+    check(dense.contains(1000000) && dense.contains(999) && dense.size() == 1001,
+          "the members survive the switch");
+
+    Membership sparse;
+    for (int i = 0; i < 65; ++i)
+    {
+        sparse.insert(1000000 - i * 64);
+    }
+    check(sparse.memory() < 1024, "65 members with large fds stay a vector");
+}
+
+int main()
+{
+    test_membership_random();
+    test_membership_switch();
+    if (failures > 0)
+    {
+        std::cerr << failures << " checks failed." << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed." << std::endl;
+    return 0;
+}
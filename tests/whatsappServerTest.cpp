@@ -0,0 +1,230 @@
+/**
+ * Tests of the servers topic subscriptions. The server is compiled into this program with
+ * WHATSAPP_SERVER_NO_MAIN, like the microbenchmarks. The topic trie is checked against a naive
+ * matcher with random operations, plus a few fixed cases. Prints the failed checks and exits
+ * with 1 if there are any.
+ */
+#include "whatsappServer.cpp"
+
+#include <cstdio>
+#include <random>
+#include <set>
+
+/**
+ * The number of failed checks.
+ */
+int failures = 0;
+
+/**
+ * Records a check.
+ * @param ok The checks result.
+ * @param what What was checked, printed if it failed.
+ */
+void check(bool ok, const std::string &what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAIL: " << what << std::endl;
+        failures++;
+    }
+}
+
+/**
+ * @param text A topic or a pattern.
+ * @return Its segments.
+ */
+std::vector<std::string> segments(const std::string &text)
+{
+    std::vector<std::string> result;
+    size_t begin = 0;
+    size_t end;
+    while ((end = text.find('.', begin)) != std::string::npos)
+    {
+        result.push_back(text.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    result.push_back(text.substr(begin));
+    return result;
+}
+
+/**
+ * Matches a topic against a pattern segment by segment, the model of the trie.
+ * @param pattern The pattern.
+ * @param topic The topic.
+ * @return True if the pattern matches the topic.
+ */
+bool naive_match(const std::string &pattern, const std::string &topic)
+{
+    std::vector<std::string> pattern_segments = segments(pattern);
+    std::vector<std::string> topic_segments = segments(topic);
+    size_t i = 0;
+    for (; i < pattern_segments.size(); ++i)
+    {
+        if (pattern_segments[i] == "#")
+        {
+            return true;
+        }
+        if (i == topic_segments.size() ||
+            (pattern_segments[i] != "*" && pattern_segments[i] != topic_segments[i]))
+        {
+            return false;
+        }
+    }
+    return i == topic_segments.size();
+}
+
+/**
+ * @param trie The trie.
+ * @param topic The topic.
+ * @return The subscribers the trie matches for the topic, sorted and without duplicates.
+ */
+std::vector<int> trie_match(const TopicTrie &trie, const std::string &topic)
+{
+    std::vector<int> result;
+    trie.match(topic, [&result](int subscriber) { result.push_back(subscriber); });
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+/**
+ * @param random The random generator.
+ * @param wildcards True to generate a pattern, False for a topic.
+ * @return A random topic or pattern of up to 4 segments out of a small alphabet, so they collide.
+ */
+std::string random_topic(std::mt19937 &random, bool wildcards)
+{
+    static const char *words[] = {"a", "b", "c"};
+    int count = 1 + random() % 4;
+    std::string topic;
+    for (int i = 0; i < count; ++i)
+    {
+        if (i > 0)
+        {
+            topic += '.';
+        }
+        int kind = random() % (wildcards ? 5 : 3);
+        if (wildcards && kind == 3)
+        {
+            topic += '*';
+        }
+        else if (wildcards && kind == 4 && i == count - 1)
+        {
+            topic += '#';
+        }
+        else
+        {
+            topic += words[random() % 3];
+        }
+    }
+    return topic;
+}
+
+/**
+ * Fixed cases of the wildcards and the topic syntax.
+ */
+void test_topic_cases()
+{
+    TopicTrie trie;
+    trie.subscribe("a.*", 1);
+    trie.subscribe("a.#", 2);
+    trie.subscribe("#", 3);
+    trie.subscribe("a.b", 4);
+    check(trie_match(trie, "a") == std::vector<int>({2, 3}), "a.# matches a, a.* does not");
+    check(trie_match(trie, "a.b") == std::vector<int>({1, 2, 3, 4}), "all match a.b");
+    check(trie_match(trie, "a.b.c") == std::vector<int>({2, 3}), "* is a single segment");
+    check(trie_match(trie, "b") == std::vector<int>({3}), "# matches any topic");
+    check(!trie.subscribe("a.*", 1), "subscribing twice fails");
+    check(!trie.unsubscribe("a.c", 1), "unsubscribing an unknown pattern fails");
+
+    check(legal_topic("a.b.c", false), "a topic is legal");
+    check(!legal_topic("a.*", false), "a topic has no wildcards");
+    check(legal_topic("*.b.#", true), "a pattern may use wildcards");
+    check(!legal_topic("a.#.b", true), "# only ends a pattern");
+    check(!legal_topic("a..b", true), "segments are not empty");
+    check(!legal_topic("a.b*", true), "a wildcard is a whole segment");
+}
+
+/**
+ * Random subscribes, unsubscribes and matches against a set of subscriptions.
+ */
+void test_topic_random()
+{
+    std::mt19937 random(1);
+    TopicTrie trie;
+    std::set<std::pair<std::string, int>> model;
+    for (int i = 0; i < 100000; ++i)
+    {
+        int operation = random() % 3;
+        std::string pattern = random_topic(random, true);
+        int subscriber = random() % 100;
+        if (operation == 0)
+        {
+            check(legal_topic(pattern, true), "random pattern " + pattern + " is legal");
+            check(trie.subscribe(pattern, subscriber) ==
+                  model.insert(std::make_pair(pattern, subscriber)).second,
+                  "subscribe " + pattern);
+        }
+        else if (operation == 1 && !model.empty())
+        {
+            auto subscription = *std::next(model.begin(), random() % model.size());
+            check(trie.unsubscribe(subscription.first, subscription.second) &&
+                  model.erase(subscription) == 1, "unsubscribe " + subscription.first);
+        }
+        else
+        {
+            std::string topic = random_topic(random, false);
+            std::set<int> expected;
+            for (const auto &subscription : model)
+            {
+                if (naive_match(subscription.first, topic))
+                {
+                    expected.insert(subscription.second);
+                }
+            }
+            check(trie_match(trie, topic) == std::vector<int>(expected.begin(), expected.end()),
+                  "match " + topic);
+        }
+        if (failures > 0)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * Unsubscribing every pattern prunes the trie back to an empty root.
+ */
+void test_topic_pruning()
+{
+    TopicTrie trie;
+    size_t empty = trie.memory();
+    std::vector<std::string> patterns = {"a.b.c", "a.*.c", "a.#", "b.*", "*.*.*.#"};
+    for (size_t i = 0; i < patterns.size(); ++i)
+    {
+        trie.subscribe(patterns[i], (int)i);
+        trie.subscribe(patterns[i], (int)i + 100);
+    }
+    check(trie.memory() > empty, "subscriptions take memory");
+    for (size_t i = 0; i < patterns.size(); ++i)
+    {
+        trie.unsubscribe(patterns[i], (int)i);
+        trie.unsubscribe(patterns[i], (int)i + 100);
+    }
+    check(trie.memory() == empty, "unsubscribing every pattern prunes the trie");
+    check(trie_match(trie, "a.b.c").empty(), "a pruned trie matches nothing");
+}
+
+int main()
+{
+    test_topic_cases();
+    test_topic_random();
+    test_topic_pruning();
+    if (failures > 0)
+    {
+        std::cerr << failures << " checks failed." << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed." << std::endl;
+    return 0;
+}
@@ -1,13 +1,14 @@
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include "whatsappClientLib.h"
 #include <cstdlib>
 #include <iostream>
 #include <unistd.h>
 #include <cstring>
+#include <cctype>
 #include <regex>
 #include <set>
+#include <string_view>
 #include <stdlib.h>
+#include <sys/timerfd.h>
 
 
 std::regex name_format("[a-zA-Z0-9]+");
@@ -15,6 +16,100 @@ std::regex names_format("[a-zA-Z0-9,]+");
 std::regex starts_comma(",.*");
 std::regex ends_comma(".*,");
 std::regex double_comma (",,");
+std::regex topic_format("[a-zA-Z0-9]+(\\.[a-zA-Z0-9]+)*");
+std::regex pattern_format("(([a-zA-Z0-9]+|\\*)\\.)*([a-zA-Z0-9]+|\\*|#)");
+
+/**
+ * The received messages that were not written to stdout yet. They are written once per loop
+ * iteration, so a burst of messages costs a single write.
+ */
+std::string output;
+
+/**
+ * In quiet mode the messages of other clients are only counted, the totals are printed every
+ * REPORT_INTERVAL seconds and at exit. The replies to this clients requests are still printed,
+ * so a failed request is not missed.
+ */
+bool quiet = false;
+uint64_t received_messages = 0;
+uint64_t received_bytes = 0;
+const int REPORT_INTERVAL = 5;
+
+/**
+ * Writes the buffered messages to stdout.
+ */
+void flush_output()
+{
+    size_t written = 0;
+    while (written < output.size())
+    {
+        ssize_t amount = write(STDOUT_FILENO, output.data() + written, output.size() - written);
+        if (amount < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (amount <= 0)
+        {
+            break;
+        }
+        written += (size_t)amount;
+    }
+    output.clear();
+}
+
+/**
+ * Prints the totals of the received messages, in quiet mode.
+ */
+void print_totals()
+{
+    std::cout << "Received " << received_messages << " messages, " << received_bytes
+              << " bytes." << std::endl;
+}
+
+/**
+ * Tells a message of another client, "name: text" or "name [topic]: text", from a reply to this
+ * clients requests. A message that starts with "ERROR: " is a reply, although ERROR is a legal
+ * name.
+ * @param message The received message.
+ * @return True if the message came from another client, False if it is a reply.
+ */
+bool is_delivery(std::string_view message)
+{
+    size_t end = message.find(": ");
+    if (end == std::string_view::npos || message.substr(0, end) == "ERROR")
+    {
+        return false;
+    }
+    std::string_view sender = message.substr(0, end);
+    size_t topic = sender.find(" [");
+    if (topic != std::string_view::npos)
+    {
+        if (sender.back() != ']' || topic + 3 == sender.size())
+        {
+            return false;
+        }
+        for (char c : sender.substr(topic + 2, sender.size() - topic - 3))
+        {
+            if (!isalnum((unsigned char)c) && c != '.')
+            {
+                return false;
+            }
+        }
+        sender = sender.substr(0, topic);
+    }
+    if (sender.empty())
+    {
+        return false;
+    }
+    for (char c : sender)
+    {
+        if (!isalnum((unsigned char)c))
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
 /**
  * A helper function that checks if a name is legal.
@@ -36,6 +131,7 @@ bool legal_name(std::string name)
  */
 void problem( int fd, std::string message, bool loc, int error_num, int exit_num)
 {
+    flush_output();
     if(loc)
     {
         std::cout << message << std::endl;
@@ -105,216 +201,193 @@ bool check_message(std::string message)
             return false;
         }
     }
-    if(word == "send")
+    else if(word == "join" || word == "leave")
     {
         message.erase(0, pos + 1);
-        pos = message.find(space);
-        if(!legal_name(message.substr(0,pos)))
-        {
-            std::cerr << "ERROR: failed to send" << std::endl;
-            return false;
-        }
-        else
+        if(pos != std::string::npos && legal_name(message))
         {
             return true;
         }
+        std::cerr << "ERROR: failed to " << word << " group \"" << message << "\"" << std::endl;
+        return false;
     }
-    std::cout << "ERROR: Invalid input." << std::endl;
-    return false;
-}
-
-
-/**
- * As part of the client-server agrement every message first of all will contain in its
- * 4 first bytes the length of the rest of the message. this message adds the length of the
- * message in the first 4 bytes.
- * @param message - the message that needs to be cushioned
- * @return - the cushioned message
- */
-std::string cushion(std::string message)
-{
-    int count = (int)message.length();
-    std::string count_char = std::to_string(count);
-    int len = (int)count_char.length();
-    for(int i=0; i < 4 - len; i++)
-    {
-        count_char = "0" + count_char;
-    }
-    return count_char + message;
-}
-
-
-/**
- * A wrapper function to write
- * @param fd - the file descripter that we want  to write into
- * @param message - the message that needs to be written to the fd
- */
-void writer(int fd, std::string message)
-{
-    message = cushion(message);
-    int count = (int)message.length();
-    int amount_writen;
-    amount_writen = (int)write(fd,message.c_str(),(size_t)count);
-    if(amount_writen < 0)
-    {
-        problem(fd,"ERROR: write ", false,errno,1);
-    }
-    if(amount_writen == 0)
-    {
-        problem(fd,"Connection failed" , true, 0,0);
-    }
-    count -= amount_writen;
-    while ((amount_writen = (int)write(fd,message.c_str(),(size_t)count)))
+    else if(word == "add_member" || word == "remove_member")
     {
-        if(amount_writen < 0)
+        std::string action = word.substr(0, word.find('_'));
+        message.erase(0, pos + 1);
+        pos = message.find(space);
+        word = message.substr(0, pos);
+        if(pos != std::string::npos && legal_name(word) && legal_name(message.substr(pos + 1)))
         {
-            problem(fd,"ERROR: write ", false,errno,1);
+            return true;
         }
-        count -= amount_writen;
+        std::cerr << "ERROR: failed to " << action << " member of group \"" << word << "\""
+                  << std::endl;
+        return false;
     }
-}
-
-/**
- * A wrapper function to the read function
- * @param fd - the file descripter that needs to be read from.
- * @return - the message read from the fd
- */
-std::string reader(int fd)
-{
-    ssize_t amount_read;
-    size_t message_length;
-    char message_length_in_string[4];
-    char *temp = message_length_in_string;
-    size_t digits = 4;
-    amount_read = read(fd,temp,digits);
-    digits -=amount_read;
-    temp += amount_read;
-    if(amount_read == 0)
+    else if(word == "subscribe" || word == "unsubscribe")
     {
-        close(fd);
-        exit(1);
-    }
-    while((amount_read = read(fd,temp,digits)) > 0)
-    {
-        digits -=amount_read;
-        temp += amount_read;
-    }
-    if (amount_read < 0)
-    {
-        problem(fd,"ERROR: read ", false,errno,1);
+        std::string action = word == "subscribe" ? "subscribe to" : "unsubscribe from";
+        message.erase(0, pos + 1);
+        if(pos != std::string::npos && std::regex_match(message, pattern_format))
+        {
+            return true;
+        }
+        std::cerr << "ERROR: failed to " << action << " \"" << message << "\"" << std::endl;
+        return false;
     }
-    message_length = atoi(message_length_in_string);
-    char message[message_length];
-    temp = message;
-    while((amount_read = read(fd,temp,message_length)) > 0)
+    else if(word == "publish")
     {
-        message_length -=amount_read;
-        temp += amount_read;
+        message.erase(0, pos + 1);
+        pos = message.find(space);
+        word = message.substr(0, pos);
+        if(pos != std::string::npos && std::regex_match(word, topic_format) &&
+                pos + 1 < message.size())
+        {
+            return true;
+        }
+        std::cerr << "ERROR: failed to publish to \"" << word << "\"" << std::endl;
+        return false;
     }
-    if (amount_read < 0)
+    if(word == "send")
     {
-        problem(fd,"ERROR: read ", false,errno,1);
+        message.erase(0, pos + 1);
+        pos = message.find(space);
+        if(!legal_name(message.substr(0,pos)))
+        {
+            std::cerr << "ERROR: failed to send" << std::endl;
+            return false;
+        }
+        else
+        {
+            return true;
+        }
     }
-    return std::string(message, atoi(message_length_in_string));
+    std::cout << "ERROR: Invalid input." << std::endl;
+    return false;
 }
 
 
 /**
- * The main function. first tries to create a socket and then connect to a server.
+ * The main function. first tries to connect to a server and register the client.
  * if everything went well, it will be able to recieve and send messages through the server
  * to the other connected clients.
- * @param argc - should be 4, otherwise error will be printed
+ * @param argc - should be 4, or 5 with --quiet, otherwise error will be printed
  * @param argv - agruments that contain the name of the client and to what ip and port
- * it wishes to atemept to connect to.
+ * it wishes to atemept to connect to. With --quiet the messages of other clients are counted
+ * instead of printed.
  * @return
  */
 int main(int argc, char *argv[])
 {
-    if (argc != 4)
+    if (argc == 5 && std::string(argv[1]) == "--quiet")
     {
-        std::cout<<"Usage: whatsappClient clientName serverAddress serverPort"<<std::endl;
-        exit(1);
+        quiet = true;
+        argv++;
+        argc--;
     }
-    int socket_fd;
-
-    std::string name = (std::string)argv[1];
-    struct sockaddr_in my_addr;
-    memset(&my_addr,0, sizeof(my_addr));
-    my_addr.sin_family = AF_INET;
-    my_addr.sin_port = htons((uint16_t)atoi(argv[3]));
-    inet_aton(argv[2],&(my_addr.sin_addr));
-
-    if ((socket_fd = socket(AF_INET, SOCK_STREAM,0))<0)
+    if (argc != 4)
     {
-        std::cerr << "ERROR: socket " << errno << std::endl;
+        std::cout<<"Usage: whatsappClient [--quiet] clientName serverAddress serverPort"<<std::endl;
         exit(1);
     }
 
+    std::string name = (std::string)argv[1];
     if(!legal_name(name))
     {
-        problem(socket_fd,"Failed to connect the server",true,0, 0);
+        problem(-1,"Failed to connect the server",true,0, 0);
     }
 
+    whatsapp::EventLoop loop;
+    whatsapp::Session session(loop, name);
 
-    if (connect(socket_fd, (struct sockaddr *)&my_addr , sizeof(my_addr)) < 0 ) {
-        problem(socket_fd,"ERROR: connect", false, errno,1);
-    }
+    session.on_registered([](whatsapp::Session &session, bool accepted)
+    {
+        if(!accepted)
+        {
+            problem(session.fd(),"Client name is already in use.",true,0,0);
+        }
+        std::cout<<"Connected Successfully."<<std::endl;
+    });
 
-    name = cushion("create_client " + name);
-    unsigned int count = (unsigned int) name.length();
-    ssize_t amount_read;
-    while((amount_read = write(socket_fd,name.c_str(),count)))
+    session.on_frame([](whatsapp::Session &session, const char *data, size_t length)
     {
-        if(amount_read < 0 )
+        std::string_view message(data, length);
+        if(message == "Unregistered successfully.")
         {
-            problem(socket_fd,"ERROR: connect ", false, errno,1);
+            problem(session.fd(),"Unregistered Successfully.",true, 0,0);
         }
-        count-=amount_read;
-    }
-    std::string ans = reader(socket_fd);
-    if(ans == "1")
+        if(message == "server_exit")
+        {
+            flush_output();
+            session.close();
+            exit(0);
+        }
+        if (quiet && is_delivery(message))
+        {
+            received_messages++;
+            received_bytes += length;
+            return;
+        }
+        output.append(data, length);
+        output += '\n';
+    });
+
+    session.on_close([](whatsapp::Session &, int error)
     {
-        problem(socket_fd,"Client name is already in use.",true,0,0);
-    }
-    std::cout<<"Connected Successfully."<<std::endl;
+        if (error != 0)
+        {
+            problem(-1,"ERROR: read ", false,error,1);
+        }
+        flush_output();
+        exit(1);
+    });
 
-    std::string message;
-    fd_set read_fds;
-    while (true)
+    loop.watch(STDIN_FILENO, [&loop, &session]()
     {
-        FD_ZERO(&read_fds);
-        FD_SET(socket_fd, &read_fds);
-        FD_SET(STDIN_FILENO, &read_fds);
-        if (select(std::max(socket_fd,STDIN_FILENO) + 1, &read_fds,NULL,NULL,NULL) < 0)
+        // The messages that arrived before this input are printed before its errors.
+        flush_output();
+        std::string message;
+        if(!getline(std::cin,message))
         {
-            problem(socket_fd,"ERROR: select ", false, errno, 1);
+            loop.unwatch(STDIN_FILENO);
+            return;
         }
-        if(FD_ISSET(STDIN_FILENO,&read_fds))
+        if(check_message(message))
         {
-            getline(std::cin,message);
-            if(check_message(message))
-            {
-                writer(socket_fd,message);
-                message = reader(socket_fd);
-                if(message == "Unregistered successfully.")
-                {
-                    problem(socket_fd,"Unregistered Successfully.",true, 0,0);
-                }
-                std::cout << message << std::endl;
-            }
+            session.send(message);
+        }
+    });
 
+    loop.on_iteration(flush_output);
+
+    if (quiet)
+    {
+        atexit(print_totals);
+        int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        struct itimerspec interval = {{REPORT_INTERVAL, 0}, {REPORT_INTERVAL, 0}};
+        if (timer < 0 || timerfd_settime(timer, 0, &interval, NULL) < 0)
+        {
+            problem(timer,"ERROR: timerfd", false, errno, 1);
         }
-        if(FD_ISSET(socket_fd,&read_fds))
+        loop.watch(timer, [timer]()
         {
-            message = reader(socket_fd);
-            if(message == "server_exit")
+            uint64_t expirations;
+            if (read(timer, &expirations, sizeof(expirations)) > 0)
             {
-                close(socket_fd);
-                exit(0);
-
+                print_totals();
             }
-            std::cout << message<< std::endl;
+        });
+    }
 
-        }
+    if (session.connect(argv[2], (uint16_t)atoi(argv[3])) < 0)
+    {
+        problem(-1,"ERROR: connect", false, errno,1);
     }
-}
\ No newline at end of file
+
+    if (loop.run() < 0)
+    {
+        problem(session.fd(),"ERROR: epoll_wait ", false, errno, 1);
+    }
+    return 0;
+}
@@ -0,0 +1,568 @@
+#include "whatsappClientLib.h"
+#include "whatsappLocalSocket.h"
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+namespace whatsapp
+{
+
+/**
+ * The size of the loops receive buffer. A frame is at most 4 + 9999 bytes so the buffer always
+ * fits several of them and a single read usually picks up everything that arrived.
+ */
+const size_t RECEIVE_BUFFER_SIZE = 64 * 1024;
+
+/**
+ * The maximal number of events handled per epoll_wait.
+ */
+const int MAX_EVENTS = 256;
+
+std::string cushion(const std::string &message)
+{
+    std::string count_char = std::to_string(message.length());
+    std::string cushioned(4 - std::min<size_t>(4, count_char.length()), '0');
+    cushioned.reserve(4 + message.length());
+    cushioned += count_char;
+    cushioned += message;
+    return cushioned;
+}
+
+/**
+ * Checks if the given address belongs to this host, in which case the server can be reached
+ * through its local socket instead of TCP.
+ * @param addr - the servers address
+ * @return true if the address is a loopback address or one of the hosts interfaces
+ */
+static bool is_local_address(struct in_addr addr)
+{
+    if ((ntohl(addr.s_addr) >> 24) == 127)
+    {
+        return true;
+    }
+    struct ifaddrs *interfaces;
+    if (getifaddrs(&interfaces) < 0)
+    {
+        return false;
+    }
+    bool found = false;
+    for (struct ifaddrs *it = interfaces; it != NULL && !found; it = it->ifa_next)
+    {
+        if (it->ifa_addr != NULL && it->ifa_addr->sa_family == AF_INET)
+        {
+            found = ((struct sockaddr_in *)it->ifa_addr)->sin_addr.s_addr == addr.s_addr;
+        }
+    }
+    freeifaddrs(interfaces);
+    return found;
+}
+
+/**
+ * Tries to connect to the local socket of a server running on this host. The socket is looked up
+ * in the users private socket directory, and is only used if the server listening on it runs as
+ * the same user.
+ * @param port - the servers port
+ * @return the connected non-blocking fd, or -1 if there is no local server on that port
+ */
+static int local_connect(uint16_t port)
+{
+    std::string dir = local_socket_dir(false);
+    std::string path = dir.empty() ? dir : local_socket_path(dir, port);
+    if (path.empty())
+    {
+        return -1;
+    }
+    struct sockaddr_un local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sun_family = AF_UNIX;
+    strncpy(local_addr.sun_path, path.c_str(), sizeof(local_addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    if (::connect(fd, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) < 0 || peer.uid != geteuid())
+    {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+EventLoop::EventLoop() : epoll_fd(epoll_create1(EPOLL_CLOEXEC)), running(false), session_count(0)
+{
+}
+
+EventLoop::~EventLoop()
+{
+    if (epoll_fd != -1)
+    {
+        ::close(epoll_fd);
+    }
+}
+
+int EventLoop::watch(int fd, std::function<void()> on_readable)
+{
+    if ((size_t)fd >= watchers.size())
+    {
+        watchers.resize((size_t)fd + 1);
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        if (errno != EPERM)
+        {
+            return -1;
+        }
+        // Regular files can not be polled, they are always readable.
+        always_ready.push_back(fd);
+    }
+    watchers[fd] = on_readable;
+    return 0;
+}
+
+void EventLoop::unwatch(int fd)
+{
+    if ((size_t)fd >= watchers.size() || !watchers[fd])
+    {
+        return;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    always_ready.erase(std::remove(always_ready.begin(), always_ready.end(), fd),
+                       always_ready.end());
+    watchers[fd] = nullptr;
+}
+
+void EventLoop::on_iteration(std::function<void()> on_iteration)
+{
+    iteration_handler = std::move(on_iteration);
+}
+
+int EventLoop::add(Session *session, uint32_t events)
+{
+    int fd = session->socket_fd;
+    if ((size_t)fd >= sessions.size())
+    {
+        sessions.resize((size_t)fd + 1, NULL);
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        return -1;
+    }
+    sessions[fd] = session;
+    session_count++;
+    return 0;
+}
+
+int EventLoop::modify(Session *session, uint32_t events)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = session->socket_fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->socket_fd, &event);
+}
+
+void EventLoop::remove(Session *session)
+{
+    int fd = session->socket_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    if ((size_t)fd < sessions.size() && sessions[fd] == session)
+    {
+        sessions[fd] = NULL;
+        session_count--;
+    }
+    cancel_flush(session);
+}
+
+void EventLoop::schedule_flush(Session *session)
+{
+    session->flush_scheduled = true;
+    pending_flush.push_back(session);
+}
+
+void EventLoop::cancel_flush(Session *session)
+{
+    if (session->flush_scheduled)
+    {
+        session->flush_scheduled = false;
+        pending_flush.erase(std::remove(pending_flush.begin(), pending_flush.end(), session),
+                            pending_flush.end());
+    }
+}
+
+int EventLoop::run_once(int timeout)
+{
+    struct epoll_event events[MAX_EVENTS];
+    if (!always_ready.empty() || !pending_flush.empty())
+    {
+        timeout = 0;
+    }
+    int count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    if (count < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        int fd = events[i].data.fd;
+        if ((size_t)fd < sessions.size() && sessions[fd] != NULL)
+        {
+            sessions[fd]->handle_events(events[i].events);
+        }
+        else if ((size_t)fd < watchers.size() && watchers[fd])
+        {
+            // A copy, the callback may unwatch its own fd.
+            std::function<void()> callback = watchers[fd];
+            callback();
+        }
+    }
+    std::vector<int> ready = always_ready;
+    for (int fd : ready)
+    {
+        std::function<void()> callback = watchers[fd];
+        callback();
+    }
+    // Everything the callbacks queued is written here, one write per session per iteration.
+    while (!pending_flush.empty())
+    {
+        Session *session = pending_flush.back();
+        pending_flush.pop_back();
+        session->flush_scheduled = false;
+        session->flush();
+    }
+    if (iteration_handler)
+    {
+        iteration_handler();
+    }
+    return count + (int)ready.size();
+}
+
+int EventLoop::run()
+{
+    running = true;
+    while (running &&
+           (session_count > 0 || !always_ready.empty() ||
+            std::any_of(watchers.begin(), watchers.end(),
+                        [](const std::function<void()> &watcher) { return (bool)watcher; })))
+    {
+        if (run_once(-1) < 0)
+        {
+            running = false;
+            return -1;
+        }
+    }
+    running = false;
+    return 0;
+}
+
+void EventLoop::stop()
+{
+    running = false;
+}
+
+Session::Session(EventLoop &loop, const std::string &name)
+    : loop(loop), client_name(name), socket_fd(-1), connecting(false),
+      awaiting_registration(false), is_registered(false), flush_scheduled(false),
+      waiting_writable(false), out_begin(0)
+{
+}
+
+Session::~Session()
+{
+    close();
+}
+
+int Session::connect(const std::string &address, uint16_t port)
+{
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (socket_fd != -1 || inet_aton(address.c_str(), &server_addr.sin_addr) == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (is_local_address(server_addr.sin_addr))
+    {
+        socket_fd = local_connect(port);
+    }
+    if (socket_fd == -1)
+    {
+        if ((socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        {
+            return -1;
+        }
+        int one = 1;
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (::connect(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        {
+            if (errno != EINPROGRESS)
+            {
+                int error = errno;
+                ::close(socket_fd);
+                socket_fd = -1;
+                errno = error;
+                return -1;
+            }
+            connecting = true;
+        }
+    }
+
+    if (loop.add(this, connecting ? EPOLLIN | EPOLLOUT : EPOLLIN) < 0)
+    {
+        int error = errno;
+        ::close(socket_fd);
+        socket_fd = -1;
+        errno = error;
+        return -1;
+    }
+    waiting_writable = connecting;
+    awaiting_registration = true;
+    send("create_client " + client_name);
+    return 0;
+}
+
+void Session::send(const std::string &message)
+{
+    if (socket_fd == -1)
+    {
+        return;
+    }
+    std::string count_char = std::to_string(message.length());
+    out.append(4 - std::min<size_t>(4, count_char.length()), '0');
+    out.append(count_char);
+    out.append(message);
+    if (!flush_scheduled && !waiting_writable)
+    {
+        loop.schedule_flush(this);
+    }
+}
+
+void Session::close()
+{
+    if (socket_fd == -1)
+    {
+        return;
+    }
+    loop.remove(this);
+    ::close(socket_fd);
+    socket_fd = -1;
+    connecting = false;
+    awaiting_registration = false;
+    is_registered = false;
+    waiting_writable = false;
+    std::string().swap(partial);
+    out.clear();
+    out_begin = 0;
+}
+
+void Session::on_registered(RegisteredHandler handler)
+{
+    registered_handler = handler;
+}
+
+void Session::on_frame(FrameHandler handler)
+{
+    frame_handler = handler;
+}
+
+void Session::on_close(CloseHandler handler)
+{
+    close_handler = handler;
+}
+
+const std::string &Session::name() const
+{
+    return client_name;
+}
+
+int Session::fd() const
+{
+    return socket_fd;
+}
+
+bool Session::connected() const
+{
+    return socket_fd != -1 && !connecting;
+}
+
+bool Session::registered() const
+{
+    return is_registered;
+}
+
+void Session::handle_events(uint32_t events)
+{
+    if (connecting)
+    {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        {
+            return;
+        }
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0)
+        {
+            fail(error);
+            return;
+        }
+        connecting = false;
+        flush();
+    }
+    else if (events & EPOLLOUT)
+    {
+        flush();
+    }
+    if (socket_fd != -1 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    {
+        receive();
+    }
+}
+
+void Session::receive()
+{
+    // The frames are delivered before the next session reads, so the loops buffer only has to
+    // be continued from the partial frame this session kept.
+    std::vector<char> &in = loop.receive_buffer;
+    if (in.empty())
+    {
+        in.resize(RECEIVE_BUFFER_SIZE);
+    }
+    size_t in_begin = 0;
+    size_t in_end = partial.size();
+    std::memcpy(in.data(), partial.data(), in_end);
+    ssize_t amount = read(socket_fd, in.data() + in_end, in.size() - in_end);
+    if (amount == 0)
+    {
+        fail(0);
+        return;
+    }
+    if (amount < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            fail(errno);
+        }
+        return;
+    }
+    in_end += (size_t)amount;
+
+    // Every complete frame in the buffer is delivered before returning to the loop.
+    while (in_end - in_begin >= 4)
+    {
+        const char *prefix = in.data() + in_begin;
+        size_t length = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            if (prefix[i] < '0' || prefix[i] > '9')
+            {
+                fail(EPROTO);
+                return;
+            }
+            length = length * 10 + (size_t)(prefix[i] - '0');
+        }
+        if (in_end - in_begin - 4 < length)
+        {
+            break;
+        }
+        const char *data = prefix + 4;
+        in_begin += 4 + length;
+        if (awaiting_registration)
+        {
+            awaiting_registration = false;
+            is_registered = (length == 1 && data[0] == '0');
+            if (registered_handler)
+            {
+                registered_handler(*this, is_registered);
+            }
+        }
+        else if (frame_handler)
+        {
+            frame_handler(*this, data, length);
+        }
+        if (socket_fd == -1)
+        {
+            return;
+        }
+    }
+    if (in_begin == in_end)
+    {
+        std::string().swap(partial);
+        return;
+    }
+    partial.assign(in.data() + in_begin, in_end - in_begin);
+}
+
+void Session::flush()
+{
+    if (socket_fd == -1 || connecting)
+    {
+        return;
+    }
+    while (out_begin < out.size())
+    {
+        ssize_t amount = write(socket_fd, out.data() + out_begin, out.size() - out_begin);
+        if (amount < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (!waiting_writable)
+                {
+                    waiting_writable = true;
+                    loop.modify(this, EPOLLIN | EPOLLOUT);
+                }
+                return;
+            }
+            fail(errno);
+            return;
+        }
+        out_begin += (size_t)amount;
+    }
+    out.clear();
+    out_begin = 0;
+    if (waiting_writable)
+    {
+        waiting_writable = false;
+        loop.modify(this, EPOLLIN);
+    }
+}
+
+void Session::fail(int error)
+{
+    CloseHandler handler = close_handler;
+    close();
+    if (handler)
+    {
+        handler(*this, error);
+    }
+}
+
+}
@@ -0,0 +1,195 @@
+#ifndef WHATSAPP_CLIENT_LIB_H
+#define WHATSAPP_CLIENT_LIB_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * An embeddable client for the whatsapp server. An EventLoop multiplexes any number of
+ * Sessions (and other fds, such as stdin) on one thread. Every Session is a non-blocking
+ * connection of one registered client. Received frames are delivered to callbacks straight from
+ * the loops receive buffer, which all its sessions share, so a session only holds on to the
+ * part of a frame that did not arrive yet. Sent messages are queued and written once per loop
+ * iteration.
+ *
+ * Nothing in the library exits the process, errors are reported through return values and the
+ * close callback. A Session must outlive its registration in the loop and must not be destroyed
+ * from inside one of its own callbacks, call close() instead. The callbacks must not run the
+ * loop they are called from.
+ */
+namespace whatsapp
+{
+
+class Session;
+
+/**
+ * The event loop that drives the sessions and the watched fds.
+ */
+class EventLoop
+{
+public:
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    /**
+     * Calls the given callback whenever the fd is readable.
+     * @param fd - the fd to watch
+     * @param on_readable - the callback
+     * @return 0 on success, -1 otherwise
+     */
+    int watch(int fd, std::function<void()> on_readable);
+
+    /**
+     * Stops watching an fd that was added with watch.
+     * @param fd - the fd to stop watching
+     */
+    void unwatch(int fd);
+
+    /**
+     * Calls the given callback at the end of every loop iteration, once the events were handled
+     * and the sessions flushed, so work can be batched per wakeup.
+     * @param on_iteration - the callback, an empty function to remove it
+     */
+    void on_iteration(std::function<void()> on_iteration);
+
+    /**
+     * Waits for events once, dispatches them and flushes the sessions that have queued output.
+     * @param timeout - the maximal wait in milliseconds, -1 to wait forever
+     * @return the number of events handled, -1 on failure
+     */
+    int run_once(int timeout);
+
+    /**
+     * Runs the loop until stop is called or there is nothing left to wait for.
+     * @return 0 when stopped, -1 on failure
+     */
+    int run();
+
+    /**
+     * Makes run return after the current iteration.
+     */
+    void stop();
+
+private:
+    friend class Session;
+
+    int add(Session *session, uint32_t events);
+    int modify(Session *session, uint32_t events);
+    void remove(Session *session);
+    void schedule_flush(Session *session);
+    void cancel_flush(Session *session);
+
+    int epoll_fd;
+    bool running;
+    size_t session_count;
+    std::vector<Session *> sessions;
+    std::vector<std::function<void()>> watchers;
+    std::vector<int> always_ready;
+    std::vector<Session *> pending_flush;
+    std::function<void()> iteration_handler;
+    /** The buffer the sessions read into, allocated on the first read. */
+    std::vector<char> receive_buffer;
+};
+
+/**
+ * A connection of one client to the server.
+ */
+class Session
+{
+public:
+    /**
+     * Called with the servers answer to the registration of the clients name.
+     */
+    typedef std::function<void(Session &session, bool accepted)> RegisteredHandler;
+
+    /**
+     * Called for every frame received after the registration. The data points into the
+     * loops receive buffer and is only valid until the callback returns.
+     */
+    typedef std::function<void(Session &session, const char *data, size_t length)> FrameHandler;
+
+    /**
+     * Called once the connection is closed by the server or fails, with the errno of the
+     * failure or 0 if the server closed the connection.
+     */
+    typedef std::function<void(Session &session, int error)> CloseHandler;
+
+    Session(EventLoop &loop, const std::string &name);
+    ~Session();
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+
+    /**
+     * Starts connecting to the server and queues the registration of the clients name. A server
+     * on this host that runs as the same user is reached through its local socket (see
+     * whatsappLocalSocket.h), others through TCP.
+     * @param address - the servers address
+     * @param port - the servers port
+     * @return 0 on success, -1 with errno set otherwise
+     */
+    int connect(const std::string &address, uint16_t port);
+
+    /**
+     * Queues a message to the server. It is written with the rest of the queued messages at the
+     * end of the loop iteration.
+     * @param message - the message to send
+     */
+    void send(const std::string &message);
+
+    /**
+     * Closes the connection without calling the close callback. Queued messages that were not
+     * written yet are dropped.
+     */
+    void close();
+
+    void on_registered(RegisteredHandler handler);
+    void on_frame(FrameHandler handler);
+    void on_close(CloseHandler handler);
+
+    const std::string &name() const;
+    int fd() const;
+    bool connected() const;
+    bool registered() const;
+
+private:
+    friend class EventLoop;
+
+    void handle_events(uint32_t events);
+    void receive();
+    void flush();
+    void fail(int error);
+
+    EventLoop &loop;
+    std::string client_name;
+    int socket_fd;
+    bool connecting;
+    bool awaiting_registration;
+    bool is_registered;
+    bool flush_scheduled;
+    bool waiting_writable;
+    /** The start of a frame that did not fully arrive yet, empty and unallocated otherwise. */
+    std::string partial;
+    std::string out;
+    size_t out_begin;
+    RegisteredHandler registered_handler;
+    FrameHandler frame_handler;
+    CloseHandler close_handler;
+};
+
+/**
+ * As part of the client-server agrement every message first of all will contain in its
+ * 4 first bytes the length of the rest of the message. this function adds the length of the
+ * message in the first 4 bytes.
+ * @param message - the message that needs to be cushioned
+ * @return - the cushioned message
+ */
+std::string cushion(const std::string &message);
+
+}
+
+#endif
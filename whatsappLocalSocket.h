@@ -0,0 +1,73 @@
+#ifndef WHATSAPP_LOCAL_SOCKET_H
+#define WHATSAPP_LOCAL_SOCKET_H
+
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+/**
+ * Where the server binds its local (unix domain) welcome socket and the clients look for it.
+ * The socket lives in a directory only its user can write to, so another user can neither take
+ * the path first nor delete the socket. The directory is WHATSAPP_SOCKET_DIR if it is set,
+ * otherwise XDG_RUNTIME_DIR, otherwise /tmp/whatsapp-<uid>, which is created if it is missing.
+ */
+namespace whatsapp
+{
+
+/**
+ * Finds the directory of the local sockets and checks it is private: a directory (not a link)
+ * owned by the current user that no one else can access.
+ * @param create - true to create the directory with mode 0700 if it does not exist
+ * @return the directory, empty if it is missing or not private
+ */
+inline std::string local_socket_dir(bool create)
+{
+    std::string dir;
+    const char *configured = getenv("WHATSAPP_SOCKET_DIR");
+    if (configured == nullptr || *configured == '\0')
+    {
+        configured = getenv("XDG_RUNTIME_DIR");
+    }
+    if (configured != nullptr && *configured != '\0')
+    {
+        dir = configured;
+    }
+    else
+    {
+        dir = "/tmp/whatsapp-" + std::to_string(geteuid());
+    }
+    if (create && mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST)
+    {
+        return std::string();
+    }
+    struct stat info;
+    if (lstat(dir.c_str(), &info) < 0 || !S_ISDIR(info.st_mode) || info.st_uid != geteuid() ||
+        (info.st_mode & 077) != 0)
+    {
+        return std::string();
+    }
+    return dir;
+}
+
+/**
+ * @param dir - the directory of the local sockets, from local_socket_dir
+ * @param port - the servers port, the socket is named after it
+ * @return the path of the local socket, empty if it does not fit in a sockaddr_un
+ */
+inline std::string local_socket_path(const std::string &dir, uint16_t port)
+{
+    std::string path = dir + "/whatsapp-" + std::to_string(port) + ".sock";
+    if (path.size() >= sizeof(((struct sockaddr_un *)nullptr)->sun_path))
+    {
+        return std::string();
+    }
+    return path;
+}
+
+}
+
+#endif
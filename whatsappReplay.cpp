@@ -0,0 +1,469 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <unistd.h>
+#include <vector>
+#include <map>
+#include <string>
+
+/**
+ * The capture file format, must match the one written by whatsappServer --capture.
+ */
+const char CAPTURE_MAGIC[4] = {'W', 'A', 'C', 'P'};
+const uint32_t CAPTURE_VERSION = 1;
+const uint8_t CAPTURE_OPEN = 0;
+const uint8_t CAPTURE_FRAME = 1;
+const uint8_t CAPTURE_CLOSE = 2;
+
+/**
+ * How long to keep reading replies after the last record was replayed, in milliseconds. In max
+ * mode it is also how long a record waits for its answer before the replay moves on.
+ */
+const int DRAIN_TIMEOUT = 1000;
+
+/**
+ * A single record of the capture file.
+ */
+struct Record
+{
+    uint8_t type;
+    uint32_t connection_id;
+    uint64_t timestamp;
+    std::string payload;
+};
+
+/**
+ * The state of a replayed connection.
+ */
+struct Connection
+{
+    int fd;
+    /** The capture closed the connection, it is shut down for writing once its output is
+     *  written and read until the server closes it. */
+    bool closing;
+    std::string out;
+    std::string in;
+    uint64_t frames_sent;
+    uint64_t replies;
+    uint64_t digest;
+};
+
+/**
+ * The replayed connections by their capture connection id.
+ */
+std::map<uint32_t, Connection> connections;
+
+/**
+ * Reads the whole capture file.
+ * @param path - the path of the capture file
+ * @param records - the vector to fill with the records of the file
+ * @return true on success, false if the file is missing or is not a capture file
+ */
+bool load_capture(const char *path, std::vector<Record> &records)
+{
+    std::ifstream file(path, std::ios::binary);
+    char magic[4];
+    uint32_t version;
+    if (!file.read(magic, sizeof(magic)) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0 ||
+        !file.read((char *)&version, sizeof(version)) || version != CAPTURE_VERSION)
+    {
+        return false;
+    }
+    Record record;
+    uint32_t length;
+    while (file.read((char *)&record.type, sizeof(record.type)) &&
+           file.read((char *)&record.connection_id, sizeof(record.connection_id)) &&
+           file.read((char *)&record.timestamp, sizeof(record.timestamp)) &&
+           file.read((char *)&length, sizeof(length)))
+    {
+        record.payload.resize(length);
+        if (length > 0 && !file.read(&record.payload[0], length))
+        {
+            std::cerr << "ERROR: truncated capture, replaying the complete records." << std::endl;
+            break;
+        }
+        records.push_back(record);
+    }
+    return true;
+}
+
+/**
+ * As part of the client-server agrement every message first of all will contain in its
+ * 4 first bytes the length of the rest of the message. this function adds the framed message
+ * to the given buffer.
+ * @param out - the buffer to append to
+ * @param message - the message that needs to be framed
+ */
+void append_frame(std::string &out, const std::string &message)
+{
+    std::string count = std::to_string(message.size());
+    out.append(4 - count.size(), '0');
+    out.append(count);
+    out.append(message);
+}
+
+/**
+ * Opens the connection of a replayed client.
+ * @param connection_id - the connections id in the capture
+ * @param server_addr - the address of the server
+ */
+void open_connection(uint32_t connection_id, const struct sockaddr_in &server_addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        std::cerr << "ERROR: socket " << errno << std::endl;
+        exit(1);
+    }
+    if (connect(fd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        std::cerr << "ERROR: connect " << errno << std::endl;
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    Connection &connection = connections[connection_id];
+    connection.fd = fd;
+    connection.closing = false;
+    connection.frames_sent = 0;
+    connection.replies = 0;
+    connection.digest = 14695981039346656037ULL;
+}
+
+/**
+ * Writes as much of the pending output of a connection as the socket accepts. A closing
+ * connection is shut down for writing once all of it was written, so the server sees the end
+ * of the requests but can still answer them.
+ * @param connection - the connection to flush
+ */
+void flush_connection(Connection &connection)
+{
+    while (!connection.out.empty())
+    {
+        ssize_t amount = write(connection.fd, connection.out.data(), connection.out.size());
+        if (amount <= 0)
+        {
+            if (amount < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                connection.out.clear();
+                break;
+            }
+            return;
+        }
+        connection.out.erase(0, (size_t)amount);
+    }
+    if (connection.closing)
+    {
+        shutdown(connection.fd, SHUT_WR);
+    }
+}
+
+/**
+ * Reads the replies that arrived on a connection and adds every complete frame to the
+ * connections reply count and digest.
+ * @param connection - the connection to read from
+ * @return false once the server closed the connection
+ */
+bool read_replies(Connection &connection)
+{
+    char buf[65536];
+    ssize_t amount;
+    while ((amount = read(connection.fd, buf, sizeof(buf))) > 0)
+    {
+        connection.in.append(buf, (size_t)amount);
+    }
+    size_t pos = 0;
+    while (connection.in.size() - pos >= 4)
+    {
+        size_t length = (size_t)atoi(connection.in.substr(pos, 4).c_str());
+        if (connection.in.size() - pos - 4 < length)
+        {
+            break;
+        }
+        for (size_t i = pos + 4; i < pos + 4 + length; ++i)
+        {
+            connection.digest = (connection.digest ^ (uint8_t)connection.in[i]) * 1099511628211ULL;
+        }
+        connection.replies++;
+        pos += 4 + length;
+    }
+    connection.in.erase(0, pos);
+    return amount != 0;
+}
+
+/**
+ * Reads the replies of a connection and closes it once the server closed it.
+ * @param connection - the connection to read from
+ */
+void receive(Connection &connection)
+{
+    if (!read_replies(connection))
+    {
+        close(connection.fd);
+        connection.fd = -1;
+    }
+}
+
+/**
+ * The answer a record waits for in max mode: a frame on its connection or, for a close, the
+ * server closing the connection.
+ */
+struct Awaited
+{
+    bool active;
+    uint32_t connection_id;
+    uint64_t replies;
+    bool close;
+};
+
+/**
+ * @param awaited - the awaited answer
+ * @return true if the answer arrived
+ */
+bool answered(const Awaited &awaited)
+{
+    const Connection &connection = connections[awaited.connection_id];
+    return connection.fd == -1 || (!awaited.close && connection.replies > awaited.replies);
+}
+
+/**
+ * Compares the results of this replay to the results file of a previous replay.
+ * @param path - the results file of the previous replay
+ * @return the number of connections whose reply count differs
+ */
+int compare_results(const char *path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << "ERROR: failed to open \"" << path << "\"." << std::endl;
+        exit(1);
+    }
+    std::string tag;
+    uint32_t connection_id;
+    uint64_t replies;
+    uint64_t digest;
+    int mismatches = 0;
+    int reordered = 0;
+    while (file >> tag >> connection_id >> replies >> std::hex >> digest >> std::dec)
+    {
+        auto it = connections.find(connection_id);
+        if (it == connections.end() || it->second.replies != replies)
+        {
+            std::cout << "mismatch " << connection_id << " expected " << replies << " got "
+                      << (it == connections.end() ? 0 : it->second.replies) << std::endl;
+            mismatches++;
+        }
+        else if (it->second.digest != digest)
+        {
+            reordered++;
+        }
+    }
+    std::cout << "mismatches " << mismatches << std::endl;
+    std::cout << "content_differs " << reordered << std::endl;
+    return mismatches;
+}
+
+/**
+ * @return the current monotonic time in nanoseconds.
+ */
+uint64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * Replays a capture written by whatsappServer --capture against a running server. Every
+ * captured connection is opened as its own connection and its frames are sent at the captured
+ * times divided by the speed. A captured close shuts the connection down for writing and its
+ * replies are read until the server closes it.
+ *
+ * With "max" the records are replayed as fast as the server answers them: in capture order, each
+ * once the one before it was answered. The server writes what a request sends to other clients
+ * before it answers the sender, so once the answer arrived everything the other connections got
+ * is already readable. It is read before the next record is sent, which makes the replies of two
+ * replays of the same capture comparable. The reply count and digest of every connection are
+ * written to the results file so two builds can be compared.
+ */
+int main(int argc, char *argv[])
+{
+    if (argc < 5 || argc > 7)
+    {
+        std::cerr << "USAGE: whatsappReplay captureFile serverAddress serverPort speed|max "
+                     "[resultsFile [previousResultsFile]]" << std::endl;
+        exit(1);
+    }
+    std::vector<Record> records;
+    if (!load_capture(argv[1], records))
+    {
+        std::cerr << "ERROR: \"" << argv[1] << "\" is not a capture file." << std::endl;
+        exit(1);
+    }
+    double speed = 0;
+    if (std::string(argv[4]) != "max" && (speed = atof(argv[4])) <= 0)
+    {
+        std::cerr << "ERROR: invalid speed." << std::endl;
+        exit(1);
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons((uint16_t)atoi(argv[3]));
+    inet_aton(argv[2], &(server_addr.sin_addr));
+
+    uint64_t start = now_ns();
+    uint64_t last_activity = start;
+    size_t next = 0;
+    Awaited awaited = {false, 0, 0, false};
+    std::vector<struct pollfd> fds;
+    std::vector<uint32_t> ids;
+    while (true)
+    {
+        uint64_t now = now_ns();
+        while (next < records.size())
+        {
+            if (speed == 0)
+            {
+                if (awaited.active && !answered(awaited) &&
+                    now - last_activity < DRAIN_TIMEOUT * 1000000ULL)
+                {
+                    break;
+                }
+                if (awaited.active)
+                {
+                    awaited.active = false;
+                    for (auto &connection : connections)
+                    {
+                        if (connection.second.fd != -1)
+                        {
+                            receive(connection.second);
+                        }
+                    }
+                }
+            }
+            else if (start + (uint64_t)(records[next].timestamp / speed) > now)
+            {
+                break;
+            }
+            const Record &record = records[next++];
+            auto it = connections.find(record.connection_id);
+            if (record.type == CAPTURE_OPEN)
+            {
+                open_connection(record.connection_id, server_addr);
+                continue;
+            }
+            if (it == connections.end() || it->second.fd == -1)
+            {
+                continue;
+            }
+            awaited = {speed == 0, record.connection_id, it->second.replies,
+                       record.type == CAPTURE_CLOSE};
+            last_activity = now;
+            if (record.type == CAPTURE_FRAME)
+            {
+                append_frame(it->second.out, record.payload);
+                it->second.frames_sent++;
+            }
+            else if (record.type == CAPTURE_CLOSE)
+            {
+                it->second.closing = true;
+            }
+            flush_connection(it->second);
+        }
+
+        fds.clear();
+        ids.clear();
+        for (auto &connection : connections)
+        {
+            if (connection.second.fd != -1)
+            {
+                short events = POLLIN;
+                if (!connection.second.out.empty())
+                {
+                    events |= POLLOUT;
+                }
+                fds.push_back({connection.second.fd, events, 0});
+                ids.push_back(connection.first);
+            }
+        }
+        int timeout = DRAIN_TIMEOUT;
+        if (next < records.size() && speed != 0)
+        {
+            uint64_t due = start + (uint64_t)(records[next].timestamp / speed);
+            timeout = due > now ? (int)((due - now) / 1000000) : 0;
+        }
+        else if (next < records.size() && !awaited.active)
+        {
+            timeout = 0;
+        }
+        int ready = poll(fds.data(), fds.size(), timeout);
+        if (ready < 0)
+        {
+            std::cerr << "ERROR: poll " << errno << std::endl;
+            exit(1);
+        }
+        for (size_t i = 0; i < fds.size() && ready > 0; ++i)
+        {
+            if (fds[i].revents == 0)
+            {
+                continue;
+            }
+            Connection &connection = connections[ids[i]];
+            if (fds[i].revents & POLLOUT)
+            {
+                flush_connection(connection);
+            }
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                receive(connection);
+            }
+            last_activity = now_ns();
+        }
+        if (next == records.size() &&
+            (fds.empty() || now_ns() - last_activity >= DRAIN_TIMEOUT * 1000000ULL))
+        {
+            break;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    uint64_t frames_sent = 0;
+    uint64_t replies = 0;
+    for (auto &connection : connections)
+    {
+        frames_sent += connection.second.frames_sent;
+        replies += connection.second.replies;
+        if (connection.second.fd != -1)
+        {
+            close(connection.second.fd);
+        }
+    }
+    std::cout << "connections " << connections.size() << std::endl;
+    std::cout << "frames_sent " << frames_sent << std::endl;
+    std::cout << "replies " << replies << std::endl;
+    std::cout << "elapsed_us " << elapsed / 1000 << std::endl;
+
+    if (argc >= 6)
+    {
+        std::ofstream results(argv[5]);
+        for (auto &connection : connections)
+        {
+            results << "connection " << connection.first << " " << connection.second.replies
+                    << " " << std::hex << connection.second.digest << std::dec << "\n";
+        }
+    }
+    if (argc == 7 && compare_results(argv[6]) != 0)
+    {
+        exit(1);
+    }
+    return 0;
+}
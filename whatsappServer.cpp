@@ -1,5 +1,4 @@
 
-#include <netdb.h>
 #include <cstdlib>
 #include <iostream>
 #include <unistd.h>
@@ -7,88 +6,1161 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <memory>
+#include <string_view>
+#include <deque>
+#include <algorithm>
 #include <regex>
 #include <limits.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include "whatsappTask.h"
+#include "whatsappLocalSocket.h"
 
 /**
- * The vector that will contain the connected fd of the clients.
+ * The heap a std::map or std::set node takes besides its value, the tree links and color. This is how the
+ * common standard libraries lay the node out, the accounting is an estimate.
+ */
+const size_t MAP_NODE_OVERHEAD = 4 * sizeof(void *);
+
+/**
+ * @param text A string.
+ * @return The heap memory the string takes, 0 if it fits in the string itself.
+ */
+size_t string_memory(const std::string &text)
+{
+    return text.capacity() > std::string().capacity() ? text.capacity() + 1 : 0;
+}
+
+/**
+ * The members of a group. Small groups are kept as a sorted vector, which is a single allocation
+ * and is searched and iterated without chasing pointers. A group with more than SMALL_LIMIT
+ * members switches to a bitmap indexed by member once the bitmap is no larger than the vector,
+ * which is usual because members are fds and the kernel hands out the lowest free fd, but not
+ * for a few members with large fds. It switches back to the vector when it shrinks to half the
+ * limit or the bitmap grows to twice the size of the vector, so a group on the edge does not
+ * convert on every change.
+ */
+class Membership
+{
+public:
+    static const size_t SMALL_LIMIT = 64;
+
+    Membership() : count(0), large(false)
+    {
+    }
+
+    /**
+     * @param member The member to look for.
+     * @return True if the given member is in the group, False otherwise.
+     */
+    bool contains(int member) const
+    {
+        if (large)
+        {
+            size_t word = (size_t)member / 64;
+            return word < bitmap.size() && (bitmap[word] >> (member % 64) & 1);
+        }
+        return std::binary_search(small.begin(), small.end(), member);
+    }
+
+    /**
+     * Adds a member to the group.
+     * @param member The member to add.
+     * @return True if the member was added, False if he was already a member.
+     */
+    bool insert(int member)
+    {
+        if (large)
+        {
+            size_t word = (size_t)member / 64;
+            if (word >= bitmap.size() && !dense(word + 1, count + 1, 2))
+            {
+                to_small();
+                return insert(member);
+            }
+            if (word >= bitmap.size())
+            {
+                bitmap.resize(word + 1, 0);
+            }
+            uint64_t bit = (uint64_t)1 << (member % 64);
+            if (bitmap[word] & bit)
+            {
+                return false;
+            }
+            bitmap[word] |= bit;
+            count++;
+            return true;
+        }
+        auto it = std::lower_bound(small.begin(), small.end(), member);
+        if (it != small.end() && *it == member)
+        {
+            return false;
+        }
+        small.insert(it, member);
+        count++;
+        if (count > SMALL_LIMIT && dense((size_t)small.back() / 64 + 1, count, 1))
+        {
+            to_bitmap();
+        }
+        return true;
+    }
+
+    /**
+     * Removes a member from the group.
+     * @param member The member to remove.
+     * @return True if the member was removed, False if he was not a member.
+     */
+    bool erase(int member)
+    {
+        if (large)
+        {
+            size_t word = (size_t)member / 64;
+            uint64_t bit = (uint64_t)1 << (member % 64);
+            if (word >= bitmap.size() || !(bitmap[word] & bit))
+            {
+                return false;
+            }
+            bitmap[word] &= ~bit;
+            count--;
+            while (!bitmap.empty() && bitmap.back() == 0)
+            {
+                bitmap.pop_back();
+            }
+            if (count <= SMALL_LIMIT / 2 || !dense(bitmap.size(), count, 2))
+            {
+                to_small();
+            }
+            return true;
+        }
+        auto it = std::lower_bound(small.begin(), small.end(), member);
+        if (it == small.end() || *it != member)
+        {
+            return false;
+        }
+        small.erase(it);
+        count--;
+        return true;
+    }
+
+    /**
+     * @return The number of members in the group.
+     */
+    size_t size() const
+    {
+        return count;
+    }
+
+    /**
+     * @return The heap memory the group takes, in bytes.
+     */
+    size_t memory() const
+    {
+        return small.capacity() * sizeof(int) + bitmap.capacity() * sizeof(uint64_t);
+    }
+
+    /**
+     * Calls the given function for every member, in ascending order.
+     * @param function The function to call with every member.
+     */
+    template <typename Function>
+    void for_each(Function function) const
+    {
+        if (!large)
+        {
+            for (int member : small)
+            {
+                function(member);
+            }
+            return;
+        }
+        for (size_t word = 0; word < bitmap.size(); ++word)
+        {
+            uint64_t bits = bitmap[word];
+            while (bits != 0)
+            {
+                function((int)(word * 64 + __builtin_ctzll(bits)));
+                bits &= bits - 1;
+            }
+        }
+    }
+
+private:
+    /**
+     * @param words The number of words of the bitmap.
+     * @param members The number of members.
+     * @param slack How many times the size of the vector the bitmap may take.
+     * @return True if a bitmap of the given words is small enough for the given members.
+     */
+    static bool dense(size_t words, size_t members, size_t slack)
+    {
+        return words * sizeof(uint64_t) <= slack * members * sizeof(int);
+    }
+
+    void to_bitmap()
+    {
+        bitmap.assign((size_t)small.back() / 64 + 1, 0);
+        for (int member : small)
+        {
+            bitmap[(size_t)member / 64] |= (uint64_t)1 << (member % 64);
+        }
+        std::vector<int>().swap(small);
+        large = true;
+    }
+
+    void to_small()
+    {
+        small.clear();
+        small.reserve(count);
+        for_each([this](int member) { small.push_back(member); });
+        std::vector<uint64_t>().swap(bitmap);
+        large = false;
+    }
+
+    std::vector<int> small;
+    std::vector<uint64_t> bitmap;
+    size_t count;
+    bool large;
+};
+
+/**
+ * The topic subscriptions. A topic is a list of segments separated by dots and a pattern may use
+ * "*" for exactly one segment and end with "#" for any number of segments, including none. The
+ * patterns are kept in a trie of segments so matching a topic follows at most an exact and a "*"
+ * branch per segment, however many subscriptions there are.
+ */
+class TopicTrie
+{
+public:
+    /**
+     * Subscribes a client to a pattern. The pattern is expected to be legal.
+     * @param pattern The pattern to subscribe to.
+     * @param subscriber The clients fd.
+     * @return True if the client was subscribed, False if he already was.
+     */
+    bool subscribe(const std::string &pattern, int subscriber)
+    {
+        Node *node = &root;
+        std::string_view rest(pattern);
+        bool last = false;
+        while (!last)
+        {
+            std::string_view segment = next_segment(rest, last);
+            if (segment == "#")
+            {
+                return node->rest.insert(subscriber);
+            }
+            std::unique_ptr<Node> &child = segment == "*" ? node->star :
+                                           node->children[std::string(segment)];
+            if (!child)
+            {
+                child = std::make_unique<Node>();
+            }
+            node = child.get();
+        }
+        return node->exact.insert(subscriber);
+    }
+
+    /**
+     * Unsubscribes a client from a pattern and drops the nodes that are left unused.
+     * @param pattern The pattern to unsubscribe from.
+     * @param subscriber The clients fd.
+     * @return True if the client was unsubscribed, False if he was not subscribed.
+     */
+    bool unsubscribe(const std::string &pattern, int subscriber)
+    {
+        return remove(root, pattern, subscriber);
+    }
+
+    /**
+     * Calls the given function for every subscriber of a pattern that matches the topic. A client
+     * with several matching patterns is given more than once.
+     * @param topic The topic, without wildcards.
+     * @param function The function to call with every subscriber.
+     */
+    template <typename Function>
+    void match(const std::string &topic, Function function) const
+    {
+        match(root, topic, false, function);
+    }
+
+    /**
+     * @return The heap memory the trie takes, in bytes, with the map nodes estimated.
+     */
+    size_t memory() const
+    {
+        return memory(root) - sizeof(Node);
+    }
+
+private:
+    struct Node
+    {
+        std::map<std::string, std::unique_ptr<Node>, std::less<>> children;
+        std::unique_ptr<Node> star;
+        /** The subscribers of the patterns that end at this node. */
+        Membership exact;
+        /** The subscribers of the patterns that continue with "#" after this node. */
+        Membership rest;
+
+        bool empty() const
+        {
+            return children.empty() && !star && exact.size() == 0 && rest.size() == 0;
+        }
+    };
+
+    /**
+     * Takes the first segment of a topic or pattern.
+     * @param rest The segments, the first one is removed.
+     * @param last Set to True if it was the last segment.
+     * @return The first segment.
+     */
+    static std::string_view next_segment(std::string_view &rest, bool &last)
+    {
+        size_t dot = rest.find('.');
+        last = dot == std::string_view::npos;
+        std::string_view segment = rest.substr(0, dot);
+        rest = last ? std::string_view() : rest.substr(dot + 1);
+        return segment;
+    }
+
+    static size_t memory(const Node &node)
+    {
+        size_t total = sizeof(Node) + node.exact.memory() + node.rest.memory();
+        for (const auto &child : node.children)
+        {
+            total += MAP_NODE_OVERHEAD + sizeof(child) + string_memory(child.first) +
+                     memory(*child.second);
+        }
+        return node.star ? total + memory(*node.star) : total;
+    }
+
+    static bool remove(Node &node, std::string_view rest, int subscriber)
+    {
+        bool last;
+        std::string_view segment = next_segment(rest, last);
+        if (segment == "#")
+        {
+            return node.rest.erase(subscriber);
+        }
+        auto child = node.children.end();
+        Node *next = node.star.get();
+        if (segment != "*")
+        {
+            child = node.children.find(segment);
+            next = child == node.children.end() ? nullptr : child->second.get();
+        }
+        if (next == nullptr)
+        {
+            return false;
+        }
+        bool removed = last ? next->exact.erase(subscriber) : remove(*next, rest, subscriber);
+        if (removed && next->empty())
+        {
+            if (segment == "*")
+            {
+                node.star.reset();
+            }
+            else
+            {
+                node.children.erase(child);
+            }
+        }
+        return removed;
+    }
+
+    template <typename Function>
+    static void match(const Node &node, std::string_view rest, bool done, Function &function)
+    {
+        node.rest.for_each(function);
+        if (done)
+        {
+            node.exact.for_each(function);
+            return;
+        }
+        bool last;
+        std::string_view segment = next_segment(rest, last);
+        auto child = node.children.find(segment);
+        if (child != node.children.end())
+        {
+            match(*child->second, rest, last, function);
+        }
+        if (node.star)
+        {
+            match(*node.star, rest, last, function);
+        }
+    }
+
+    Node root;
+};
+
+/**
+ * The vector that will contain the connected fd of the clients. The order is not kept, a
+ * disconnected client is replaced by the last one.
  */
 std::vector<int> connected_fds;
 
 /**
- * A map from a clients name to his fd.
+ * A map from a groups name to his members fds.
+ */
+std::map<std::string, Membership> group_to_clients;
+
+/**
+ * The topic subscriptions of all the clients.
+ */
+TopicTrie topics;
+
+/**
+ * A map from a clients fd to the patterns he is subscribed to.
+ */
+std::map<int, std::vector<std::string>> fd_to_patterns;
+
+/**
+ * The output of a connection is buffered and written whenever the socket is writable. A handler
+ * that finds more than HIGH_WATER bytes pending waits until they drain below LOW_WATER.
+ */
+const size_t HIGH_WATER = 64 * 1024;
+const size_t LOW_WATER = 16 * 1024;
+
+/**
+ * The most output a connection may have pending. A client that lets more pile up is
+ * disconnected, even before its slow timeout, so the senders to a client that does not read
+ * cannot grow the servers memory.
+ */
+const size_t MAX_OUTPUT = 16 * HIGH_WATER;
+
+/**
+ * The amount read from a client per wakeup.
+ */
+const size_t READ_SIZE = 16 * 1024;
+
+/**
+ * The state of a connected client. The table is indexed by fd, which the kernel hands out
+ * densely, so the fd is the clients slot and the groups and subscriptions refer to him by it.
+ * An idle client holds no heap memory here: names up to the strings inline capacity are stored
+ * in place and the buffers are taken from buffer_pool only while there is something in them.
+ */
+struct Connection
+{
+    /** A unique id per accepted connection, tells apart clients that got the same fd. */
+    uint64_t id;
+    /** The clients name, empty until he registers. Until then he counts against the pending
+     *  limit. */
+    std::string name;
+    std::string in;
+    std::string out;
+    size_t out_begin;
+    /** The suspended handlers waiting for the output to drain, with the amount they wait for. */
+    std::vector<std::pair<std::coroutine_handle<>, size_t>> writers;
+    /** Since when, in milliseconds, handlers wait on the output without any of them waking. */
+    uint64_t stalled_since;
+    /** The position of the fd in connected_fds. */
+    uint32_t index;
+    /** The events the connection is registered for in the epoll set, 0 if it is not in it. */
+    uint32_t events;
+    bool open;
+    /** A handler of this connection is running, its next requests wait in the input buffer. */
+    bool busy;
+    /** The requests in the input buffer are being dispatched. */
+    bool dispatching;
+    /** The connection will be closed once its output is written. */
+    bool closing;
+    /** The connection is in dirty_fds, its epoll events are updated by the main loop. */
+    bool dirty;
+};
+
+/**
+ * The connections, indexed by fd.
+ */
+std::vector<Connection> connections;
+
+/**
+ * Orders the registered clients fds by their names in the connection table. It also compares a
+ * fd with a name, so the index is searched by name without keeping a copy of the names.
+ */
+struct NameOrder
+{
+    using is_transparent = void;
+
+    bool operator()(int first, int second) const
+    {
+        return connections[first].name < connections[second].name;
+    }
+
+    bool operator()(int fd, std::string_view name) const
+    {
+        return connections[fd].name < name;
+    }
+
+    bool operator()(std::string_view name, int fd) const
+    {
+        return name < connections[fd].name;
+    }
+};
+
+/**
+ * The fds of the registered clients, by name. A client is in it from the moment he registers
+ * until he exits, and his name does not change in between.
+ */
+std::set<int, NameOrder> name_to_fd;
+
+/**
+ * The id that will be given to the next accepted connection.
+ */
+uint64_t next_connection_id = 0;
+
+/**
+ * Buffers that are not used by any connection. A connection takes one when it has input or
+ * output to hold and gives it back once the buffer is empty.
+ */
+std::vector<std::string> buffer_pool;
+
+/**
+ * The maximal number of buffers kept in the pool and the largest buffer that is kept, larger
+ * ones are freed.
+ */
+const size_t BUFFER_POOL_SIZE = 64;
+const size_t MAX_POOLED_BUFFER = 2 * HIGH_WATER;
+
+/**
+ * The number of open connections that did not register yet.
+ */
+size_t pending_registrations = 0;
+
+/**
+ * The suspended handlers that can continue, they are resumed by the main loop.
+ */
+std::vector<std::coroutine_handle<>> ready_handlers;
+
+/**
+ * The fd of the local (unix domain) welcome socket, -1 if the local transport is not available.
+ */
+int local_socket = -1;
+
+/**
+ * The path the local welcome socket is bound to.
+ */
+std::string local_socket_path;
+
+/**
+ * The servers startup configuration, set from the command line.
+ */
+struct ServerConfig
+{
+    /** The address the TCP welcome socket is bound to. */
+    struct in_addr bind_address;
+    /** The length of the welcome sockets accept queues, the kernel caps it at somaxconn. */
+    int backlog;
+    /** Set TCP_NODELAY on the clients so the short replies are not held back by Nagle. */
+    bool nodelay;
+    /** Seconds a TCP connection may wait for its first request before it is accepted, 0 to
+     *  accept on the handshake (TCP_DEFER_ACCEPT). */
+    int defer_accept;
+    /** The maximal number of connections that did not register yet. While that many are
+     *  pending new connections wait in the accept queue. */
+    size_t max_pending;
+    /** Boot the local welcome socket. It is only booted when the server listens on every
+     *  address, otherwise it would let in clients the TCP socket does not. */
+    bool local;
+    /** Seconds handlers may wait on a clients output before the client is disconnected as too
+     *  slow, so a client that stops reading does not stall his senders for ever. */
+    int slow_timeout;
+    /** Seconds a connection may take to register, so idle connections cannot hold the pending
+     *  slots and keep the welcome sockets closed. */
+    int register_timeout;
+};
+
+ServerConfig config = {{INADDR_ANY}, 4096, true, 0, 4096, true, 10, 10};
+
+/**
+ * The maximal number of connections accepted from a welcome socket per wakeup, so a storm of
+ * connections does not starve the clients that are already connected.
+ */
+const int ACCEPT_BATCH = 256;
+
+/**
+ * The maximal number of events handled per epoll_wait.
+ */
+const int MAX_EVENTS = 1024;
+
+/**
+ * The epoll instance of the main loop, -1 when the server functions run without it.
+ */
+int epoll_fd = -1;
+
+/**
+ * The connections whose epoll events may have to change, updated once per loop iteration so
+ * a request that is handled right away does not cost an epoll_ctl.
+ */
+std::vector<int> dirty_fds;
+
+/**
+ * A time by which a connection has to make progress. The connection may have been closed and
+ * its fd reused since, the id tells.
+ */
+struct Deadline
+{
+    /** The time, in milliseconds of the monotonic clock. */
+    uint64_t time;
+    int fd;
+    uint64_t id;
+};
+
+/**
+ * The deadlines of the connections whose output stalled, oldest first. A connection gets a new
+ * deadline whenever it makes progress, the earlier ones are skipped when they expire.
+ */
+std::deque<Deadline> stall_deadlines;
+
+/**
+ * The registration deadlines of the accepted connections, oldest first. The ones of connections
+ * that registered or closed meanwhile are skipped when they expire.
+ */
+std::deque<Deadline> registration_deadlines;
+
+/**
+ * Accepting was stopped because the server ran out of fds, it resumes when a connection
+ * closes.
+ */
+bool accept_paused = false;
+
+/**
+ * A regex that represents a legal name.
+ */
+std::regex name_format("[a-zA-Z0-9]+");
+
+
+/**
+ * The capture file format. The file starts with CAPTURE_MAGIC and CAPTURE_VERSION (4 bytes
+ * each) followed by records. A record is a one byte type, a 4 byte connection id, an 8 byte
+ * timestamp in nanoseconds since the capture started, a 4 byte length and that many bytes of
+ * payload. Integers are stored in host byte order. The connection id is the id of the
+ * connection, so fds that are reused after a disconnect can be told apart. A frame is recorded
+ * when the read that completes it returns, not when it is handled, so the time its connection
+ * waits for a suspended handler is not replayed as the clients think time.
+ */
+const char CAPTURE_MAGIC[4] = {'W', 'A', 'C', 'P'};
+const uint32_t CAPTURE_VERSION = 1;
+const uint8_t CAPTURE_OPEN = 0;
+const uint8_t CAPTURE_FRAME = 1;
+const uint8_t CAPTURE_CLOSE = 2;
+
+/**
+ * The capture is buffered and written to the file once per loop iteration, or sooner once the
+ * buffer reaches this size, so that recording does not add a syscall per frame.
+ */
+const size_t CAPTURE_FLUSH_SIZE = 64 * 1024;
+
+/**
+ * The fd of the capture file, -1 if the traffic is not captured.
+ */
+int capture_fd = -1;
+
+/**
+ * The records that were not written to the capture file yet.
+ */
+std::string capture_buffer;
+
+/**
+ * The time the capture started.
+ */
+struct timespec capture_start;
+
+/**
+ * Writes the buffered records to the capture file.
+ */
+void capture_flush()
+{
+    const char *data = capture_buffer.data();
+    size_t count = capture_buffer.size();
+    ssize_t amount;
+    while (count > 0 && (amount = write(capture_fd, data, count)) > 0)
+    {
+        data += amount;
+        count -= amount;
+    }
+    if (count > 0)
+    {
+        std::cerr<<"ERROR: capture write "<<errno<<"."<<std::endl;
+    }
+    capture_buffer.clear();
+}
+
+/**
+ * Opens the capture file and writes its header.
+ * @param path The path of the capture file.
+ */
+void capture_open(const char *path)
+{
+    if ((capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    {
+        std::cerr<<"ERROR: open "<<errno<<"."<<std::endl;
+        exit(1);
+    }
+    capture_buffer.reserve(CAPTURE_FLUSH_SIZE * 2);
+    capture_buffer.append(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    capture_buffer.append((const char *)&CAPTURE_VERSION, sizeof(CAPTURE_VERSION));
+    clock_gettime(CLOCK_MONOTONIC, &capture_start);
+    capture_flush();
+}
+
+/**
+ * Adds a record to the capture. Does nothing if the traffic is not captured.
+ * @param type The record type.
+ * @param fd The fd of the connection the record belongs to.
+ * @param data The payload of the record.
+ * @param length The payload length.
+ */
+void capture_record(uint8_t type, int fd, const char *data, uint32_t length)
+{
+    if (capture_fd == -1)
+    {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t timestamp = (uint64_t)(now.tv_sec - capture_start.tv_sec) * 1000000000ULL +
+                         now.tv_nsec - capture_start.tv_nsec;
+    uint32_t connection_id = (uint32_t)connections[fd].id;
+    capture_buffer.append((const char *)&type, sizeof(type));
+    capture_buffer.append((const char *)&connection_id, sizeof(connection_id));
+    capture_buffer.append((const char *)&timestamp, sizeof(timestamp));
+    capture_buffer.append((const char *)&length, sizeof(length));
+    capture_buffer.append(data, length);
+    if (capture_buffer.size() >= CAPTURE_FLUSH_SIZE)
+    {
+        capture_flush();
+    }
+}
+
+/**
+ * @return The time of the monotonic clock in milliseconds.
+ */
+uint64_t monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/**
+ * A helper function that checks if a name is legal.
+ * @param name The name to check.
+ * @return True if the name is legal, False otherwise.
+ */
+bool legal_name(std::string name)
+{
+    return ((name_to_fd.find(name) == name_to_fd.end()) &&
+            (group_to_clients.find(name) == group_to_clients.end()) &&
+            std::regex_match(name, name_format));
+}
+
+/**
+ * A helper function that checks if a topic or a subscription pattern is legal. Its segments are
+ * separated by dots and each of them is a legal name, a pattern may also use "*" for a segment
+ * and "#" for the last one.
+ * @param topic The topic or pattern to check.
+ * @param wildcards True to allow wildcards.
+ * @return True if the topic is legal, False otherwise.
+ */
+bool legal_topic(const std::string &topic, bool wildcards)
+{
+    size_t begin = 0;
+    while (true)
+    {
+        size_t end = std::min(topic.find('.', begin), topic.size());
+        std::string segment = topic.substr(begin, end - begin);
+        bool wildcard = segment == "*" || (segment == "#" && end == topic.size());
+        if (!(wildcards && wildcard) && !std::regex_match(segment, name_format))
+        {
+            return false;
+        }
+        if (end == topic.size())
+        {
+            return true;
+        }
+        begin = end + 1;
+    }
+}
+
+void client_exit_request(int fd, bool flag);
+
+/**
+ * Checks that a connection is still the one a handler started with. A handler that was
+ * suspended may find that the client disconnected and the fd was given to a new client.
+ * @param fd The connections fd.
+ * @param id The connections id when the handler started.
+ * @return True if the connection is still open, False otherwise.
+ */
+bool connected(int fd, uint64_t id)
+{
+    return (size_t)fd < connections.size() && connections[fd].open && connections[fd].id == id;
+}
+
+/**
+ * Starts the slow timeout of a connection that handlers wait on.
+ * @param fd The connections fd.
+ */
+void start_stall(int fd)
+{
+    Connection &connection = connections[fd];
+    connection.stalled_since = monotonic_ms();
+    stall_deadlines.push_back({connection.stalled_since + (uint64_t)config.slow_timeout * 1000,
+                               fd, connection.id});
+}
+
+/**
+ * Moves the handlers waiting on a connection whose output drained below their limit (or that
+ * was closed) to the ready list. The handlers that keep waiting get a new slow timeout, the
+ * connection made progress.
+ * @param fd The connections fd.
+ */
+void wake_writers(int fd)
+{
+    Connection &connection = connections[fd];
+    size_t pending = connection.out.size() - connection.out_begin;
+    bool woke = false;
+    for (auto it = connection.writers.begin(); it != connection.writers.end();)
+    {
+        if (!connection.open || pending <= std::min(it->second, LOW_WATER))
+        {
+            ready_handlers.push_back(it->first);
+            it = connection.writers.erase(it);
+            woke = true;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    if (woke && !connection.writers.empty())
+    {
+        start_stall(fd);
+    }
+}
+
+/**
+ * Gives an empty connection buffer a pooled allocation, if it has none of its own.
+ * @param buffer The buffer.
+ */
+void acquire_buffer(std::string &buffer)
+{
+    if (buffer.empty() && buffer.capacity() == std::string().capacity() && !buffer_pool.empty())
+    {
+        buffer.swap(buffer_pool.back());
+        buffer_pool.pop_back();
+    }
+}
+
+/**
+ * Returns the allocation of an emptied connection buffer to the pool, or frees it when the pool
+ * is full.
+ * @param buffer The buffer, empty and without an allocation afterwards.
  */
-std::map<std::string, int> name_to_fd;
+void release_buffer(std::string &buffer)
+{
+    buffer.clear();
+    if (buffer.capacity() == std::string().capacity())
+    {
+        return;
+    }
+    if (buffer_pool.size() < BUFFER_POOL_SIZE && buffer.capacity() <= MAX_POOLED_BUFFER)
+    {
+        buffer_pool.emplace_back();
+        buffer_pool.back().swap(buffer);
+        return;
+    }
+    std::string().swap(buffer);
+}
 
 /**
- * A map from a clients fd to his name.
+ * Queues a connection for an update of its epoll events at the end of the loop iteration.
+ * @param fd The connections fd.
  */
-std::map<int, std::string> fd_to_name;
+void mark_dirty(int fd)
+{
+    if (epoll_fd != -1 && !connections[fd].dirty)
+    {
+        connections[fd].dirty = true;
+        dirty_fds.push_back(fd);
+    }
+}
 
 /**
- * A map from a groups name to a set of his members fds.
+ * Registers a connection for the events its state calls for: input while no handler runs,
+ * only the hangup while one does, and output while some is pending. A connection that waits
+ * for none of them is taken out of the epoll set, otherwise a hangup would be reported on every
+ * wakeup.
+ * @param fd The connections fd.
  */
-std::map<std::string, std::set<int>> group_to_clients;
+void update_events(int fd)
+{
+    Connection &connection = connections[fd];
+    connection.dirty = false;
+    if (!connection.open)
+    {
+        return;
+    }
+    uint32_t events = 0;
+    if (!connection.closing)
+    {
+        events |= connection.busy ? EPOLLRDHUP : EPOLLIN;
+    }
+    if (connection.out_begin < connection.out.size())
+    {
+        events |= EPOLLOUT;
+    }
+    if (events == connection.events)
+    {
+        return;
+    }
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+    int operation = connection.events == 0 ? EPOLL_CTL_ADD :
+                    events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl(epoll_fd, operation, fd, &event) < 0)
+    {
+        std::cerr<<"ERROR: epoll_ctl "<<errno<<"."<<std::endl;
+    }
+    connection.events = events;
+}
 
 /**
- * A regex that represents a legal name.
+ * Starts tracking a newly accepted connection. The fd is expected to be non-blocking.
+ * @param fd The connections fd.
  */
-std::regex name_format("[a-zA-Z0-9]+");
+void open_connection(int fd)
+{
+    if ((size_t)fd >= connections.size())
+    {
+        connections.resize((size_t)fd + 1);
+    }
+    Connection &connection = connections[fd];
+    connection.id = next_connection_id++;
+    connection.open = true;
+    connection.busy = false;
+    connection.dispatching = false;
+    connection.closing = false;
+    connection.events = 0;
+    connection.in.clear();
+    connection.out.clear();
+    connection.out_begin = 0;
+    connection.index = (uint32_t)connected_fds.size();
+    connected_fds.push_back(fd);
+    ++pending_registrations;
+    registration_deadlines.push_back({monotonic_ms() + (uint64_t)config.register_timeout * 1000,
+                                      fd, connection.id});
+    if (epoll_fd != -1)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            std::cerr<<"ERROR: epoll_ctl "<<errno<<"."<<std::endl;
+        }
+        connection.events = EPOLLIN;
+    }
+    capture_record(CAPTURE_OPEN, fd, NULL, 0);
+}
 
+/**
+ * Closes a connection, drops its buffers and wakes the handlers that wait on it.
+ * @param fd The connections fd.
+ */
+void close_connection(int fd)
+{
+    Connection &connection = connections[fd];
+    connection.open = false;
+    wake_writers(fd);
+    release_buffer(connection.in);
+    release_buffer(connection.out);
+    connection.out_begin = 0;
+    if (connection.name.empty())
+    {
+        --pending_registrations;
+    }
+    std::string().swap(connection.name);
+    int last = connected_fds.back();
+    connected_fds[connection.index] = last;
+    connections[last].index = connection.index;
+    connected_fds.pop_back();
+    // Closing the fd also takes it out of the epoll set.
+    close(fd);
+    accept_paused = false;
+}
 
 /**
- * A helper function that checks if a name is legal.
- * @param name The name to check.
- * @return True if the name is legal, False otherwise.
+ * Writes as much of a connections pending output as the socket accepts.
+ * @param fd The connections fd.
  */
-bool legal_name(std::string name)
+void flush_connection(int fd)
 {
-    return ((name_to_fd.find(name) == name_to_fd.end()) &&
-            (group_to_clients.find(name) == group_to_clients.end()) &&
-            std::regex_match(name, name_format));
+    Connection &connection = connections[fd];
+    ssize_t amount = 0;
+    while (connection.out_begin < connection.out.size() &&
+           (amount = write(fd, connection.out.data() + connection.out_begin,
+                           connection.out.size() - connection.out_begin)) > 0)
+    {
+        connection.out_begin += (size_t)amount;
+    }
+    if (amount == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        std::cerr<<"ERROR: write "<<errno<<"."<<std::endl;
+        client_exit_request(fd,false);
+        return;
+    }
+    if (connection.out_begin == connection.out.size())
+    {
+        release_buffer(connection.out);
+        connection.out_begin = 0;
+        if (connection.closing)
+        {
+            close_connection(fd);
+            return;
+        }
+    }
+    else if (connection.out_begin >= LOW_WATER)
+    {
+        connection.out.erase(0, connection.out_begin);
+        connection.out_begin = 0;
+    }
+    mark_dirty(fd);
+    wake_writers(fd);
 }
 
-void client_exit_request(int fd, bool flag);
+/**
+ * Checks that a message fits in a connections output. A client whose output would grow past
+ * MAX_OUTPUT is disconnected.
+ * @param fd The connections fd.
+ * @param size The size of the framed message.
+ * @return True if the message can be queued, False if the client is not connected.
+ */
+bool output_fits(int fd, size_t size)
+{
+    if ((size_t)fd >= connections.size() || !connections[fd].open)
+    {
+        return false;
+    }
+    Connection &connection = connections[fd];
+    if (connection.out.size() - connection.out_begin + size <= MAX_OUTPUT)
+    {
+        return true;
+    }
+    std::cerr<<connection.name<<": ERROR: too much pending output, disconnected."<<std::endl;
+    client_exit_request(fd, false);
+    return false;
+}
 
 /**
- * This functions a wrapper for the write sys call that adds to the beginning of a message its
- * length for are protocol and checks the write success.
+ * This functions adds to the beginning of a message its length for are protocol, queues it on
+ * the connection and writes what the socket accepts right away. The rest is written by the main
+ * loop when the socket is writable.
  * @param fd The fd to write to.
  * @param message The message to send to the client with the given fd.
- * @return on failure -1, if the client is disconnected 0 will be returned and on success the
- *         amount written.
+ * @return -1 if the client is not connected, 0 otherwise.
  */
-int write_wrapper(int fd, std::string message)
+int write_wrapper(int fd, const std::string &message)
 {
-    std::string length = std::to_string(message.size());
-    while (length.size() != 4)
+    if (!output_fits(fd, 4 + message.size()))
     {
-        length.insert(0,"0");
+        return -1;
     }
-    message = length + message;
-    ssize_t amount = write(fd, message.c_str(), message.size());
-    if (amount == 0)
+    Connection &connection = connections[fd];
+    acquire_buffer(connection.out);
+    std::string length = std::to_string(message.size());
+    connection.out.append(4 - std::min<size_t>(4, length.size()), '0');
+    connection.out.append(length);
+    connection.out.append(message);
+    flush_connection(fd);
+    return connections[fd].open ? 0 : -1;
+}
+
+/**
+ * Adds the length of a message to its beginning, so a message that goes to many clients is
+ * framed once.
+ * @param message The message.
+ * @return The message as it is sent.
+ */
+std::string make_frame(const std::string &message)
+{
+    std::string length = std::to_string(message.size());
+    std::string frame(4 - std::min<size_t>(4, length.size()), '0');
+    frame.reserve(4 + message.size());
+    frame.append(length);
+    frame.append(message);
+    return frame;
+}
+
+/**
+ * Queues a message that was already framed on the connection, like write_wrapper.
+ * @param fd The fd to write to.
+ * @param frame The framed message.
+ * @return -1 if the client is not connected, 0 otherwise.
+ */
+int write_frame(int fd, const std::string &frame)
+{
+    if (!output_fits(fd, frame.size()))
     {
-        return 1;
+        return -1;
     }
-    if (amount == -1)
+    acquire_buffer(connections[fd].out);
+    connections[fd].out.append(frame);
+    flush_connection(fd);
+    return connections[fd].open ? 0 : -1;
+}
+
+/**
+ * An awaitable that suspends a handler until a connection has at most limit bytes of pending
+ * output. It is ready right away when the output is already below the limit. A connection whose
+ * handlers wait for longer than the slow timeout is disconnected, which resumes them.
+ */
+struct Writable
+{
+    int fd;
+    uint64_t id;
+    size_t limit;
+
+    bool await_ready() const
     {
-        std::cerr<<"ERROR: write "<<errno<<"."<<std::endl;
-        client_exit_request(fd,false);
+        return !connected(fd, id) ||
+               connections[fd].out.size() - connections[fd].out_begin <= limit;
     }
-    message = message.substr((unsigned long)amount);
-    while ((amount = write(fd, message.c_str(), message.size()))>0)
+
+    void await_suspend(std::coroutine_handle<> handler)
     {
-        message = message.substr((unsigned long)amount);
+        if (connections[fd].writers.empty())
+        {
+            start_stall(fd);
+        }
+        connections[fd].writers.push_back(std::make_pair(handler, limit));
     }
-    if (amount == -1)
+
+    /**
+     * @return True if the connection is still open, False if it was closed meanwhile.
+     */
+    bool await_resume() const
     {
-        std::cerr<<"ERROR: write "<<errno<<"."<<std::endl;
-        client_exit_request(fd,false);
+        return connected(fd, id);
     }
-    return (int)amount;
+};
+
+/**
+ * @param fd The fd to wait on.
+ * @param limit The amount of pending output the handler can continue with.
+ * @return An awaitable for the connections output to drain to the limit.
+ */
+Writable writable(int fd, size_t limit = HIGH_WATER)
+{
+    return Writable{fd, (size_t)fd < connections.size() ? connections[fd].id : 0, limit};
 }
 
 /**
@@ -96,60 +1168,98 @@ int write_wrapper(int fd, std::string message)
  * @param fd The clients fd.
  * @param flag A flag that represents if to send a message to the client.
  *             This is because we can disconnect from a client if he is no longer connected and
- *             we dont want to write to him in this case.
+ *             we dont want to write to him in this case. The connection is closed once the
+ *             message was written.
  */
 void client_exit_request(int fd, bool flag)
 {
-    std::string name = fd_to_name[fd];
-    name_to_fd.erase(fd_to_name[fd]);
-    fd_to_name.erase(fd);
+    if ((size_t)fd >= connections.size() || !connections[fd].open)
+    {
+        return;
+    }
+    capture_record(CAPTURE_CLOSE, fd, NULL, 0);
+    std::string name = connections[fd].name;
+    auto client = name_to_fd.find(name);
+    if (client != name_to_fd.end())
+    {
+        name_to_fd.erase(client);
+    }
     for(auto map_it = group_to_clients.begin(); map_it != group_to_clients.end(); ++map_it){
-        for(auto set_it = (*map_it).second.begin(); set_it != (*map_it).second.end();){
-            if((*set_it) == fd){
-                set_it = map_it->second.erase(set_it);
-            } else {
-                ++set_it;
-            }
+        map_it->second.erase(fd);
+    }
+    auto patterns = fd_to_patterns.find(fd);
+    if (patterns != fd_to_patterns.end())
+    {
+        for (const std::string &pattern : patterns->second)
+        {
+            topics.unsubscribe(pattern, fd);
         }
+        fd_to_patterns.erase(patterns);
     }
     if (flag)
     {
         std::string exit_message("Unregistered successfully.");
         std::cout<<name<<": Unregistered successfully."<<std::endl;
-        write_wrapper(fd, exit_message);
+        if (write_wrapper(fd, exit_message) == 0)
+        {
+            connections[fd].closing = true;
+            flush_connection(fd);
+        }
+        return;
     }
-    connected_fds.erase(std::remove(connected_fds.begin(), connected_fds.end(), fd),
-                        connected_fds.end());
-    close(fd);
+    close_connection(fd);
 }
 
 /**
- * In are protocol we send the message length as the first 4 bytes so this function reads the
- * beginning ant returns the messages length.
- * @param fd The fd to read from.
- * @return The message length.
+ * Disconnects the clients whose handlers waited on their output for longer than the slow
+ * timeout and the connections that did not register in time, a name that was taken included.
+ * @param now The current time in milliseconds.
  */
-size_t get_message_length(int fd)
+void expire_deadlines(uint64_t now)
 {
-    char buf[4];
-    char *temp = buf;
-    ssize_t amount;
-    size_t count = 4;
-    while((amount = read(fd,temp, count)) > 0)
+    while (!registration_deadlines.empty() && registration_deadlines.front().time <= now)
     {
-        temp += amount;
-        count -= amount;
+        Deadline deadline = registration_deadlines.front();
+        registration_deadlines.pop_front();
+        if (connected(deadline.fd, deadline.id) && connections[deadline.fd].name.empty())
+        {
+            client_exit_request(deadline.fd, false);
+        }
     }
-    if (amount == -1)
+    while (!stall_deadlines.empty() && stall_deadlines.front().time <= now)
     {
-        std::cerr<<"ERROR: read "<<errno<<"."<<std::endl;
-        client_exit_request(fd,false);
+        Deadline deadline = stall_deadlines.front();
+        stall_deadlines.pop_front();
+        if (connected(deadline.fd, deadline.id) && !connections[deadline.fd].writers.empty() &&
+            connections[deadline.fd].stalled_since + (uint64_t)config.slow_timeout * 1000 <= now)
+        {
+            std::cerr<<connections[deadline.fd].name<<": ERROR: does not read, disconnected."
+                     <<std::endl;
+            client_exit_request(deadline.fd, false);
+        }
+    }
+}
+
+/**
+ * @param now The current time in milliseconds.
+ * @return The milliseconds until the next deadline, -1 if there is none.
+ */
+int next_deadline(uint64_t now)
+{
+    if (stall_deadlines.empty() && registration_deadlines.empty())
+    {
+        return -1;
+    }
+    uint64_t time = UINT64_MAX;
+    if (!stall_deadlines.empty())
+    {
+        time = stall_deadlines.front().time;
     }
-    if (buf == temp)
+    if (!registration_deadlines.empty())
     {
-        return 0;
+        time = std::min(time, registration_deadlines.front().time);
     }
-    return atoi(buf);
+    return time > now ? (int)(time - now) : 0;
 }
 
 
@@ -159,48 +1269,140 @@ size_t get_message_length(int fd)
  * @param group_name The group name to create.
  * @param clients_names The names of the clients that should be members in the group.
  */
-void create_group(int fd, std::string group_name, std::deque<std::string> clients_names)
+whatsapp::Task<> create_group(int fd, std::string group_name, std::deque<std::string> clients_names)
 {
     std::string message;
     message.clear();
     if (legal_name(group_name))
     {
-        std::set<int> set;
-        set.clear();
+        Membership set;
         set.insert(fd);
         while (clients_names.size() != 0)
         {
-            if (name_to_fd.find(clients_names.front()) != name_to_fd.end())
+            auto client = name_to_fd.find(clients_names.front());
+            if (client != name_to_fd.end())
             {
                 //FOUND
-                set.insert(name_to_fd[clients_names.front()]);
+                set.insert(*client);
                 clients_names.pop_front();
             }
             else
             {
                 //NOT FOUND
-                set.clear();
+                set = Membership();
                 break;
             }
         }
         if (set.size() < 2)
         {
             message += "ERROR: failed to create group \""+group_name+"\".";
-            std::cerr<<fd_to_name[fd]<<": ERORR: failed to create group \""<<group_name<<"\"."<<std::endl;
+            std::cerr<<connections[fd].name<<": ERORR: failed to create group \""<<group_name<<"\"."<<std::endl;
         }
         if (message.size() == 0)
         {
-            group_to_clients.insert(std::pair<std::string, std::set<int>>(group_name, set));
+            group_to_clients.insert(std::pair<std::string, Membership>(group_name, std::move(set)));
             message += "Group \""+group_name+"\" was created successfully.";
-            std::cout<<fd_to_name[fd]<<": Group \""<<group_name<<"\" was created successfully."<<std::endl;
+            std::cout<<connections[fd].name<<": Group \""<<group_name<<"\" was created successfully."<<std::endl;
         }
     }
     else
     {
         message += "ERROR: failed to create group \""+group_name+"\".";
-        std::cerr<<fd_to_name[fd]<<": ERORR: failed to create group \""<<group_name<<"\"."<<std::endl;
+        std::cerr<<connections[fd].name<<": ERORR: failed to create group \""<<group_name<<"\"."<<std::endl;
+    }
+    write_wrapper(fd, message);
+    co_await writable(fd);
+}
+
+/**
+ * The function that handles a join request, the client joins an existing group.
+ * @param fd The fd of the client that wants to join.
+ * @param group_name The group to join.
+ */
+whatsapp::Task<> join_group(int fd, std::string group_name)
+{
+    std::string message;
+    auto group = group_to_clients.find(group_name);
+    if (group != group_to_clients.end() && group->second.insert(fd))
+    {
+        message = "Joined group \""+group_name+"\" successfully.";
+        std::cout<<connections[fd].name<<": Joined group \""<<group_name<<"\" successfully."<<std::endl;
+    }
+    else
+    {
+        message = "ERROR: failed to join group \""+group_name+"\".";
+        std::cerr<<connections[fd].name<<": ERROR: failed to join group \""<<group_name<<"\"."<<std::endl;
+    }
+    write_wrapper(fd, message);
+    co_await writable(fd);
+}
+
+/**
+ * The function that handles a leave request, the client leaves a group he is a member of.
+ * The group stays even if it is left empty so its name remains reserved.
+ * @param fd The fd of the client that wants to leave.
+ * @param group_name The group to leave.
+ */
+whatsapp::Task<> leave_group(int fd, std::string group_name)
+{
+    std::string message;
+    auto group = group_to_clients.find(group_name);
+    if (group != group_to_clients.end() && group->second.erase(fd))
+    {
+        message = "Left group \""+group_name+"\" successfully.";
+        std::cout<<connections[fd].name<<": Left group \""<<group_name<<"\" successfully."<<std::endl;
+    }
+    else
+    {
+        message = "ERROR: failed to leave group \""+group_name+"\".";
+        std::cerr<<connections[fd].name<<": ERROR: failed to leave group \""<<group_name<<"\"."<<std::endl;
+    }
+    write_wrapper(fd, message);
+    co_await writable(fd);
+}
+
+/**
+ * The function that handles add_member and remove_member requests. Only a member of the group
+ * can change its members.
+ * @param fd The fd of the client that requested the change.
+ * @param group_name The group to change.
+ * @param client_name The name of the client to add or remove.
+ * @param add True to add the client, False to remove him.
+ */
+whatsapp::Task<> change_member(int fd, std::string group_name, std::string client_name, bool add)
+{
+    std::string message;
+    std::string action = add ? "add" : "remove";
+    auto group = group_to_clients.find(group_name);
+    auto client = name_to_fd.find(client_name);
+    if (group != group_to_clients.end() && client != name_to_fd.end() &&
+        group->second.contains(fd) &&
+        (add ? group->second.insert(*client) : group->second.erase(*client)))
+    {
+        message = "Group \""+group_name+"\" was updated successfully.";
+        std::cout<<connections[fd].name<<": "<<(add ? "Added " : "Removed ")<<client_name<<
+                (add ? " to" : " from")<<" group \""<<group_name<<"\"."<<std::endl;
+    }
+    else
+    {
+        message = "ERROR: failed to "+action+" "+client_name+" in group \""+group_name+"\".";
+        std::cerr<<connections[fd].name<<": ERROR: failed to "<<action<<" "<<client_name<<
+                " in group \""<<group_name<<"\"."<<std::endl;
     }
     write_wrapper(fd, message);
+    co_await writable(fd);
+}
+
+/**
+ * Registers a connection under a name. The name is expected to be legal.
+ * @param fd The clients fd.
+ * @param name The clients name.
+ */
+void register_client(int fd, const std::string &name)
+{
+    connections[fd].name = name;
+    name_to_fd.insert(fd);
+    --pending_registrations;
 }
 
 /**
@@ -208,14 +1410,14 @@ void create_group(int fd, std::string group_name, std::deque<std::string> client
  * @param fd The fd of the client to create.
  * @param name The name of the client to create.
  */
-void create_client(int fd, std::string name)
+whatsapp::Task<> create_client(int fd, std::string name)
 {
     std::string message;
     message.clear();
-    if (legal_name(name))
+    // A connection keeps the name it registered with.
+    if (connections[fd].name.empty() && legal_name(name))
     {
-        fd_to_name.insert(std::pair<int, std::string>(fd, name));
-        name_to_fd.insert(std::pair<std::string, int>(name, fd));
+        register_client(fd, name);
         message += "0";
         std::cout<<name<<" connected."<<std::endl;
     }
@@ -224,35 +1426,34 @@ void create_client(int fd, std::string name)
         message += "1";
     }
     write_wrapper(fd, message);
+    co_await writable(fd);
 }
 
 /**
  * The function that handles a who request.
  * @param fd The fd of the client who requested the qho request.
  */
-void who_request(int fd)
+whatsapp::Task<> who_request(int fd)
 {
-    std::vector<std::string> clients;
-    clients.clear();
-    for (std::pair<std::string, int> client_info : name_to_fd)
-    {
-        clients.push_back(client_info.first);
-    }
-    std::sort(clients.begin(), clients.end());
+    // The index is ordered by name, so the names come out sorted.
     std::string message;
     message.clear();
-    for (int i=0; i<(int)clients.size(); ++i)
+    for (int client : name_to_fd)
     {
-        message.append(clients[i]);
+        message.append(connections[client].name);
         message.append(",");
     }
     message.pop_back();
-    std::cout<<fd_to_name[fd]<<": Requests the currently connected client names."<<std::endl;
+    std::cout<<connections[fd].name<<": Requests the currently connected client names."<<std::endl;
     write_wrapper(fd, message);
+    co_await writable(fd);
 }
 
 /**
- * This function handles a send a message to a single client.
+ * This function handles a send a message to a single client. It waits for the receivers output
+ * to drain before answering the sender, so a slow receiver slows down the senders requests
+ * instead of growing the servers buffers. A receiver that does not drain within the slow timeout
+ * is disconnected and the send fails.
  * @param sender_fd The senders fd.
  * @param receiver_fd The receivers fd.
  * @param message The message to send.
@@ -260,88 +1461,327 @@ void who_request(int fd)
  *                            the sender.
  * @return 0 on success, -1 otherwise.
  */
-int send_message_request(int sender_fd, int receiver_fd, std::string message,
-                         bool sender_message_flag)
+whatsapp::Task<int> send_message_request(int sender_fd, int receiver_fd, std::string message,
+                                         bool sender_message_flag)
 {
     int return_value;
+    uint64_t sender_id = connections[sender_fd].id;
+    std::string sender_name = connections[sender_fd].name;
+    std::string receiver_name = connections[receiver_fd].name;
     std::string message_to_user;
     message_to_user.clear();
     std::string receiver_message;
     receiver_message.clear();
-    receiver_message += fd_to_name[sender_fd];
+    receiver_message += sender_name;
     receiver_message += ": ";
     receiver_message += message;
     switch (write_wrapper(receiver_fd, receiver_message)){
-        case 1://CLIENT NOT CONNECTED
+        case -1://CLIENT NOT CONNECTED
             return_value = -1;
             message_to_user += "ERROR: failed to send.";
             break;
         default://SEND SUCCESSES
-            return_value = 0;
-            message_to_user += "Sent successfully.";
+            if (co_await writable(receiver_fd))
+            {
+                return_value = 0;
+                message_to_user += "Sent successfully.";
+            }
+            else// THE RECEIVER WAS DISCONNECTED BEFORE HE READ IT
+            {
+                return_value = -1;
+                message_to_user += "ERROR: failed to send.";
+            }
             break;
     }
     if (sender_message_flag)
     {
-        if (message_to_user == "ERROR: failed to send.")
+        if (return_value == -1)
         {
-            std::cerr<< fd_to_name[sender_fd]<<": ERROR: failed to send \""<<message<<"\" to "
-                    ""<<fd_to_name[receiver_fd]<<"."<<std::endl;
+            std::cerr<< sender_name<<": ERROR: failed to send \""<<message<<"\" to "
+                    ""<<receiver_name<<"."<<std::endl;
         }
         else
         {
-            std::cout<<fd_to_name[sender_fd]<<": \""<< message<<"\" was sent successfully "
-                    "to "<<fd_to_name[receiver_fd]<<"."<<std::endl;
+            std::cout<<sender_name<<": \""<< message<<"\" was sent successfully "
+                    "to "<<receiver_name<<"."<<std::endl;
+        }
+        if (connected(sender_fd, sender_id))
+        {
+            write_wrapper(sender_fd,message_to_user);
+            co_await writable(sender_fd);
         }
-        write_wrapper(sender_fd,message_to_user);
     }
-    return return_value;
+    co_return return_value;
 }
 
 /**
- * This function handels a request to send a message to a group.
+ * This function handels a request to send a message to a group. The message is queued to all
+ * the members first and only then the handler waits for the members whose output is above the
+ * high water mark.
  * @param sender_fd The senders fd.
  * @param group_name The groups name.
- * @param receivers_fds A set of the receivers fds.
+ * @param receivers_fds The groups members.
  * @param message The message to send.
  */
-void send_group_message_request(int sender_fd,std::string group_name, std::set<int> receivers_fds,
-                                std::string message)
+whatsapp::Task<> send_group_message_request(int sender_fd, std::string group_name,
+                                            const Membership &receivers_fds, std::string message)
 {
+    // A failed write disconnects the receiver and removes him from the group, so the members are
+    // copied out first. The vector is reused between requests to avoid an allocation per send.
+    static std::vector<int> receivers;
+    receivers.clear();
+    receivers_fds.for_each([](int receiver_fd) { receivers.push_back(receiver_fd); });
+    uint64_t sender_id = connections[sender_fd].id;
+    std::string sender_name = connections[sender_fd].name;
+    std::string receiver_frame = make_frame(sender_name + ": " + message);
+    std::vector<Writable> slow_receivers;
     std::string message_to_user;
     message_to_user.clear();
-    for (auto receiver_fd : receivers_fds)
+    for (auto receiver_fd : receivers)
     {
         if (sender_fd != receiver_fd)
         {
-            if (send_message_request(sender_fd, receiver_fd, message, false) == -1)
+            if (write_frame(receiver_fd, receiver_frame) == -1)
             {
                 message_to_user += "ERROR: failed to send.";
-                std::cerr<< fd_to_name[sender_fd]<<": ERROR: failed to send \""<<message<<"\" to "
+                std::cerr<< sender_name<<": ERROR: failed to send \""<<message<<"\" to "
                         ""<<group_name<<"."<<std::endl;
                 break;
             }
+            Writable receiver = writable(receiver_fd);
+            if (!receiver.await_ready())
+            {
+                slow_receivers.push_back(receiver);
+            }
         }
     }
+    for (Writable &receiver : slow_receivers)
+    {
+        co_await receiver;
+    }
     if (message_to_user.size() == 0)
     {
         message_to_user += "Sent successfully.";
-        std::cout<<fd_to_name[sender_fd]<<": \""<<message<<"\" was sent successfully to "<<group_name<<"."<<std::endl;
+        std::cout<<sender_name<<": \""<<message<<"\" was sent successfully to "<<group_name<<"."<<std::endl;
+    }
+    if (connected(sender_fd, sender_id))
+    {
+        write_wrapper(sender_fd, message_to_user);
+        co_await writable(sender_fd);
+    }
+}
+
+/**
+ * The function that handles a subscribe or unsubscribe request.
+ * @param fd The clients fd.
+ * @param pattern The pattern to subscribe to or unsubscribe from.
+ * @param subscribe True to subscribe, False to unsubscribe.
+ */
+whatsapp::Task<> change_subscription(int fd, std::string pattern, bool subscribe)
+{
+    std::string message;
+    std::string action(subscribe ? "subscribe to" : "unsubscribe from");
+    std::vector<std::string> &patterns = fd_to_patterns[fd];
+    bool changed = false;
+    if (legal_topic(pattern, true))
+    {
+        if (subscribe && topics.subscribe(pattern, fd))
+        {
+            patterns.push_back(pattern);
+            changed = true;
+        }
+        else if (!subscribe && topics.unsubscribe(pattern, fd))
+        {
+            patterns.erase(std::find(patterns.begin(), patterns.end(), pattern));
+            changed = true;
+        }
+    }
+    if (patterns.empty())
+    {
+        fd_to_patterns.erase(fd);
+    }
+    if (changed)
+    {
+        message = (subscribe ? "Subscribed to \"" : "Unsubscribed from \"") + pattern +
+                  "\" successfully.";
+        std::cout<<connections[fd].name<<": "<<message<<std::endl;
+    }
+    else
+    {
+        message = "ERROR: failed to " + action + " \"" + pattern + "\".";
+        std::cerr<<connections[fd].name<<": "<<message<<std::endl;
+    }
+    write_wrapper(fd, message);
+    co_await writable(fd);
+}
+
+/**
+ * The function that handles a publish request. The message is framed once and queued to every
+ * subscriber of a matching pattern, then the handler waits for the subscribers that are over the
+ * high water mark, like a group message.
+ * @param sender_fd The publishers fd.
+ * @param topic The topic to publish to.
+ * @param message The message to publish.
+ */
+whatsapp::Task<> publish_request(int sender_fd, std::string topic, std::string message)
+{
+    // The subscribers are collected before any write since a failed write unsubscribes the
+    // receiver. The vector is reused between requests to avoid an allocation per publish.
+    static std::vector<int> receivers;
+    receivers.clear();
+    uint64_t sender_id = connections[sender_fd].id;
+    std::string sender_name = connections[sender_fd].name;
+    std::string message_to_user;
+    if (!legal_topic(topic, false))
+    {
+        message_to_user = "ERROR: failed to publish to \"" + topic + "\".";
+        std::cerr<<sender_name<<": "<<message_to_user<<std::endl;
+        write_wrapper(sender_fd, message_to_user);
+        co_await writable(sender_fd);
+        co_return;
+    }
+    topics.match(topic, [](int receiver_fd) { receivers.push_back(receiver_fd); });
+    // A client with several matching patterns gets the message once.
+    std::sort(receivers.begin(), receivers.end());
+    receivers.erase(std::unique(receivers.begin(), receivers.end()), receivers.end());
+    std::string receiver_frame = make_frame(sender_name + " [" + topic + "]: " + message);
+    std::vector<Writable> slow_receivers;
+    size_t delivered = 0;
+    for (int receiver_fd : receivers)
+    {
+        if (receiver_fd != sender_fd && write_frame(receiver_fd, receiver_frame) == 0)
+        {
+            delivered++;
+            Writable receiver = writable(receiver_fd);
+            if (!receiver.await_ready())
+            {
+                slow_receivers.push_back(receiver);
+            }
+        }
+    }
+    for (Writable &receiver : slow_receivers)
+    {
+        co_await receiver;
+    }
+    message_to_user = "Published successfully to " + std::to_string(delivered) + " subscribers.";
+    std::cout<<sender_name<<": \""<<message<<"\" was published to "<<topic<<"."<<std::endl;
+    if (connected(sender_fd, sender_id))
+    {
+        write_wrapper(sender_fd, message_to_user);
+        co_await writable(sender_fd);
+    }
+}
+
+/**
+ * The memory the servers state takes, in bytes.
+ */
+struct MemoryUsage
+{
+    size_t clients;
+    size_t registered;
+    /** The connection table and connected_fds. */
+    size_t sessions;
+    /** The name index and the names that do not fit inline. */
+    size_t names;
+    /** The input and output buffers the connections hold. */
+    size_t buffers;
+    /** The buffers in the pool. */
+    size_t pooled;
+    size_t groups;
+    size_t topics;
+
+    size_t total() const
+    {
+        return sessions + names + buffers + pooled + groups + topics;
+    }
+};
+
+/**
+ * Adds up the memory the servers state takes. The coroutine frames and the allocator overhead
+ * are not counted.
+ * @return The memory usage.
+ */
+MemoryUsage memory_usage()
+{
+    MemoryUsage usage = {};
+    usage.clients = connected_fds.size();
+    usage.registered = name_to_fd.size();
+    usage.sessions = connections.capacity() * sizeof(Connection) +
+                     connected_fds.capacity() * sizeof(int);
+    usage.names = name_to_fd.size() * (MAP_NODE_OVERHEAD + sizeof(int));
+    for (int fd : connected_fds)
+    {
+        const Connection &connection = connections[fd];
+        usage.names += string_memory(connection.name);
+        usage.buffers += string_memory(connection.in) + string_memory(connection.out) +
+                         connection.writers.capacity() * sizeof(connection.writers[0]);
+    }
+    usage.pooled = buffer_pool.capacity() * sizeof(std::string);
+    for (const std::string &buffer : buffer_pool)
+    {
+        usage.pooled += string_memory(buffer);
+    }
+    for (const auto &group : group_to_clients)
+    {
+        usage.groups += MAP_NODE_OVERHEAD + sizeof(group) + string_memory(group.first) +
+                        group.second.memory();
+    }
+    usage.topics = topics.memory();
+    for (const auto &patterns : fd_to_patterns)
+    {
+        usage.topics += MAP_NODE_OVERHEAD + sizeof(patterns) +
+                        patterns.second.capacity() * sizeof(std::string);
+        for (const std::string &pattern : patterns.second)
+        {
+            usage.topics += string_memory(pattern);
+        }
     }
-    write_wrapper(sender_fd, message_to_user);
+    return usage;
+}
+
+/**
+ * Prints the memory usage report of the MEMORY command.
+ */
+void print_memory_usage()
+{
+    MemoryUsage usage = memory_usage();
+    std::cout<<"Memory usage: "<<usage.clients<<" clients, "<<usage.registered<<" registered."
+             <<std::endl;
+    std::cout<<"  sessions: "<<usage.sessions<<" bytes."<<std::endl;
+    std::cout<<"  names: "<<usage.names<<" bytes."<<std::endl;
+    std::cout<<"  buffers: "<<usage.buffers<<" bytes, "<<usage.pooled<<" bytes pooled ("
+             <<buffer_pool.size()<<" buffers)."<<std::endl;
+    std::cout<<"  groups: "<<usage.groups<<" bytes in "<<group_to_clients.size()<<" groups."
+             <<std::endl;
+    std::cout<<"  topics: "<<usage.topics<<" bytes."<<std::endl;
+    std::cout<<"  total: "<<usage.total()<<" bytes, "
+             <<(usage.clients ? usage.total() / usage.clients : 0)<<" bytes per client."
+             <<std::endl;
 }
 
 /**
- * This function handles a request from the servers admin to EXIT.
+ * This function shuts the server down, on the EXIT command of the servers admin or on SIGINT or
+ * SIGTERM. The capture is closed first, telling the clients may block.
  */
 void server_shutdown(int welcome_socket)
 {
-    std::cout << "EXIT command is typed: server is shutting down" << std::endl;
+    if (capture_fd != -1)
+    {
+        capture_flush();
+        close(capture_fd);
+    }
     for (int fd: connected_fds)
     {
+        // The server is going down anyway, so block until the pending output is written.
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
         write_wrapper(fd, std::string("server_exit"));
     }
     close(welcome_socket);
+    if (local_socket != -1)
+    {
+        close(local_socket);
+        unlink(local_socket_path.c_str());
+    }
     exit(0);
 }
 
@@ -352,29 +1792,30 @@ void server_shutdown(int welcome_socket)
  */
 int server_boot(uint16_t port_num)
 {
-    char hostname[HOST_NAME_MAX];
     int s;
-    struct hostent *hp;
+    int on = 1;
     struct sockaddr_in my_addr;
 
-    gethostname(hostname, HOST_NAME_MAX);
-    if ((hp = gethostbyname(hostname)) == NULL)
-    {
-        std::cerr<<"ERROR: gethostbyname "<<errno<<"."<<std::endl;
-        exit(1);
-    }
-
     memset(&my_addr, 0, sizeof(struct sockaddr_in));
     my_addr.sin_family = AF_INET;
-    my_addr.sin_addr.s_addr = INADDR_ANY;
+    my_addr.sin_addr = config.bind_address;
     my_addr.sin_port = htons(port_num);
 
-    if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if ((s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
     {
         std::cerr<<"ERROR: socket "<<errno<<"."<<std::endl;
         exit(1);
     }
 
+    // A restarted server must not wait for the connections of the previous one to time out.
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (config.defer_accept > 0 &&
+        setsockopt(s, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept,
+                   sizeof(config.defer_accept)) < 0)
+    {
+        std::cerr<<"ERROR: setsockopt "<<errno<<"."<<std::endl;
+    }
+
     if (bind(s, (struct sockaddr *) &my_addr, sizeof(struct sockaddr_in)) < 0)
     {
         std::cerr<<"ERROR: bind "<<errno<<"."<<std::endl;
@@ -382,16 +1823,134 @@ int server_boot(uint16_t port_num)
         exit(1);
     }
 
-    if (listen(s, 10) < 0)
+    if (listen(s, config.backlog) < 0)
+    {
+        std::cerr<<"ERROR: listen "<<errno<<"."<<std::endl;
+        close(s);
+        exit(1);
+    }
+
+    return s;
+}
+
+/**
+ * This function boots the local welcome socket. Clients that run on the same host as the server
+ * connect through it instead of loopback TCP, they find it from the port they already get. It is
+ * bound in the users private socket directory so no other user can take or replace it, a server
+ * that can not bind it exits instead of leaving the clients to whatever is at the path.
+ * @param port_num The servers port number.
+ * @return The fd of the local welcome socket.
+ */
+int local_boot(uint16_t port_num)
+{
+    int s;
+    struct sockaddr_un my_addr;
+
+    std::string dir = whatsapp::local_socket_dir(true);
+    if (dir.empty() || (local_socket_path = whatsapp::local_socket_path(dir, port_num)).empty())
+    {
+        std::cerr<<"ERROR: no private directory for the local socket, set WHATSAPP_SOCKET_DIR "
+                   "or use --no-local."<<std::endl;
+        exit(1);
+    }
+    memset(&my_addr, 0, sizeof(struct sockaddr_un));
+    my_addr.sun_family = AF_UNIX;
+    strncpy(my_addr.sun_path, local_socket_path.c_str(), sizeof(my_addr.sun_path) - 1);
+
+    if ((s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    {
+        std::cerr<<"ERROR: socket "<<errno<<"."<<std::endl;
+        exit(1);
+    }
+
+    // A previous server that did not shut down cleanly leaves the socket file behind.
+    unlink(local_socket_path.c_str());
+    if (bind(s, (struct sockaddr *) &my_addr, sizeof(struct sockaddr_un)) < 0)
+    {
+        std::cerr<<"ERROR: bind "<<errno<<"."<<std::endl;
+        close(s);
+        exit(1);
+    }
+
+    if (listen(s, config.backlog) < 0)
     {
         std::cerr<<"ERROR: listen "<<errno<<"."<<std::endl;
         close(s);
+        unlink(local_socket_path.c_str());
         exit(1);
     }
 
     return s;
 }
 
+/**
+ * Accepts the connections waiting on a welcome socket, at most ACCEPT_BATCH of them and only
+ * while the number of pending registrations is below the limit. The rest stay in the accept
+ * queue for the next wakeup.
+ * @param welcome_socket The non-blocking welcome socket.
+ * @param tcp True for the TCP welcome socket, False for the local one.
+ */
+void accept_connections(int welcome_socket, bool tcp)
+{
+    int on = 1;
+    for (int i = 0; i < ACCEPT_BATCH && pending_registrations < config.max_pending; ++i)
+    {
+        int t = accept4(welcome_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (t < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+            {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                std::cerr<<"ERROR: accept "<<errno<<", accepting is paused."<<std::endl;
+                accept_paused = true;
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                std::cerr<<"ERROR: accept "<<errno<<"."<<std::endl;
+            }
+            return;
+        }
+        if (tcp && config.nodelay)
+        {
+            setsockopt(t, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        open_connection(t);
+    }
+}
+
+/**
+ * Registers the welcome sockets in the epoll set while the server admits new connections and
+ * takes them out while it does not.
+ * @param welcome_sockets The welcome sockets, -1 for one that is not available.
+ * @param listening Whether the welcome sockets are currently registered, updated.
+ */
+void update_listeners(const std::vector<int> &welcome_sockets, bool &listening)
+{
+    bool admit = !accept_paused && pending_registrations < config.max_pending;
+    if (admit == listening)
+    {
+        return;
+    }
+    for (int welcome_socket : welcome_sockets)
+    {
+        if (welcome_socket == -1)
+        {
+            continue;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = welcome_socket;
+        if (epoll_ctl(epoll_fd, admit ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, welcome_socket, &event) < 0)
+        {
+            std::cerr<<"ERROR: epoll_ctl "<<errno<<"."<<std::endl;
+        }
+    }
+    listening = admit;
+}
+
 /**
  * This function handles the parsing of a message and splits it by delimiter.
  * @param message The whole message.
@@ -414,161 +1973,482 @@ std::deque<std::string> split(std::string message, std::string delimiter)
     return deque;
 }
 
+void dispatch_frames(int fd);
+
 /**
- * The main function that boots the program and the loop running as long as the server is up
- * listening
+ * The function that handles a single request of a client. The requests of a client are handled
+ * one at a time, while this handler is suspended the next ones wait in the input buffer.
+ * @param fd The clients fd.
+ * @param frame The request without its length.
  */
-int main(int argc, char *argv[])
+whatsapp::Task<> handle_frame(int fd, std::string frame)
 {
-    if (argc != 2)
+    uint64_t id = connections[fd].id;
+    connections[fd].busy = true;
+    mark_dirty(fd);
+    std::deque<std::string> message = split(frame, " ");
+    if (message.front() == "create_client")
     {
-        std::cerr << "USAGE: whatsappServer portNum" << std::endl;
-        exit(1);
+        message.pop_front();
+        co_await create_client(fd,message.front());
     }
-    name_to_fd.clear();
-    fd_to_name.clear();
-    group_to_clients.clear();
-    connected_fds.clear();
+    else
+    {
+        if (connections[fd].name.empty())
+        {
+            std::string message_to_user("2");
+            write_wrapper(fd, message_to_user);
+        }
+        else if (message.front() == "create_group")
+        {
+            message.pop_front();
+            std::string group_name = message.front();
+            message.pop_front();
+            co_await create_group(fd, group_name, split(message.front(), ","));
+        }
+        else if ((message.front() == "join" || message.front() == "leave") &&
+                 message.size() == 2)
+        {
+            bool join = message.front() == "join";
+            message.pop_front();
+            if (join)
+            {
+                co_await join_group(fd, message.front());
+            }
+            else
+            {
+                co_await leave_group(fd, message.front());
+            }
+        }
+        else if ((message.front() == "add_member" ||
+                  message.front() == "remove_member") && message.size() == 3)
+        {
+            bool add = message.front() == "add_member";
+            message.pop_front();
+            std::string group_name = message.front();
+            message.pop_front();
+            co_await change_member(fd, group_name, message.front(), add);
+        }
+        else if ((message.front() == "subscribe" || message.front() == "unsubscribe") &&
+                 message.size() == 2)
+        {
+            bool subscribe = message.front() == "subscribe";
+            message.pop_front();
+            co_await change_subscription(fd, message.front(), subscribe);
+        }
+        else if (message.front() == "publish" && message.size() >= 3)
+        {
+            message.pop_front();
+            std::string topic = message.front();
+            message.pop_front();
+            std::string the_message("");
+            while (!message.empty())
+            {
+                the_message += message.front();
+                the_message += " ";
+                message.pop_front();
+            }
+            the_message.pop_back();
+            co_await publish_request(fd, topic, the_message);
+        }
+        else if (message.front() == "who")
+        {
+            co_await who_request(fd);
+        }
+        else if (message.front() == "exit")
+        {
+            client_exit_request(fd, true);
+        }
+        else if (message.front() == "send")
+        {
+            message.pop_front();
+            std::string receiver_name = message.front();
+            message.pop_front();
+            std::string the_message("");
+            while (!message.empty())
+            {
+                the_message += message.front();
+                the_message += " ";
+                message.pop_front();
+            }
+            the_message.pop_back();
+            auto receiver = name_to_fd.find(receiver_name);
+            if (receiver != name_to_fd.end())
+            {
+                co_await send_message_request(fd,*receiver,the_message,true);
+            }
+            else if (group_to_clients.find(receiver_name) !=
+                    group_to_clients.end() &&
+                    group_to_clients[receiver_name].contains(fd))
+            {
+                co_await send_group_message_request(fd,receiver_name,
+                                                    group_to_clients[receiver_name], the_message);
+            }
+            else
+            {
+                std::string message_to_user("ERROR: failed to send.");
+                std::cerr<< connections[fd].name<<": ERROR: failed to send "
+                        "\""<<the_message<<"\" to "<<receiver_name<<"."<<std::endl;
+                write_wrapper(fd, message_to_user);
+            }
+        }
+    }
+    if (connected(fd, id))
+    {
+        connections[fd].busy = false;
+        mark_dirty(fd);
+        if (!connections[fd].dispatching)
+        {
+            dispatch_frames(fd);
+        }
+    }
+}
 
-    int s = server_boot((uint16_t) atoi(argv[1]));
+/**
+ * Starts a handler for every complete request in a connections input buffer, until one of them
+ * suspends. In are protocol we send the message length as the first 4 bytes.
+ * @param fd The connections fd.
+ */
+void dispatch_frames(int fd)
+{
+    uint64_t id = connections[fd].id;
+    size_t pos = 0;
+    connections[fd].dispatching = true;
+    while (connected(fd, id) && !connections[fd].busy && !connections[fd].closing &&
+           connections[fd].in.size() - pos >= 4)
+    {
+        std::string &in = connections[fd].in;
+        size_t message_length = (size_t)atoi(in.substr(pos, 4).c_str());
+        if (message_length == 0)
+        {
+            client_exit_request(fd, false);
+            return;
+        }
+        if (in.size() - pos - 4 < message_length)
+        {
+            break;
+        }
+        std::string frame = in.substr(pos + 4, message_length);
+        pos += 4 + message_length;
+        whatsapp::spawn(handle_frame(fd, std::move(frame)));
+    }
+    if (connected(fd, id))
+    {
+        connections[fd].in.erase(0, pos);
+        if (connections[fd].in.empty())
+        {
+            release_buffer(connections[fd].in);
+        }
+        connections[fd].dispatching = false;
+    }
+}
+
+/**
+ * Records the requests a read completed. The input buffer starts at a request and the requests
+ * that were complete before the read were recorded by an earlier one.
+ * @param fd The clients fd.
+ * @param old_size The size of the input buffer before the read.
+ */
+void capture_frames(int fd, size_t old_size)
+{
+    const std::string &in = connections[fd].in;
+    size_t pos = 0;
+    while (capture_fd != -1 && in.size() - pos >= 4)
+    {
+        size_t message_length = (size_t)atoi(in.substr(pos, 4).c_str());
+        if (message_length == 0 || in.size() - pos - 4 < message_length)
+        {
+            return;
+        }
+        pos += 4 + message_length;
+        if (pos > old_size)
+        {
+            capture_record(CAPTURE_FRAME, fd, in.data() + pos - message_length,
+                           (uint32_t)message_length);
+        }
+    }
+}
 
-    int t;
+/**
+ * Reads what arrived from a client and handles the complete requests.
+ * @param fd The clients fd.
+ */
+void read_connection(int fd)
+{
+    std::string &in = connections[fd].in;
+    acquire_buffer(in);
+    size_t old_size = in.size();
+    in.resize(old_size + READ_SIZE);
+    ssize_t amount = read(fd, &in[old_size], READ_SIZE);
+    in.resize(old_size + (amount > 0 ? (size_t)amount : 0));
+    if (amount == 0)
+    {
+        client_exit_request(fd, false);
+        return;
+    }
+    if (amount == -1)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            std::cerr<<"ERROR: read "<<errno<<"."<<std::endl;
+            client_exit_request(fd, false);
+        }
+        else if (in.empty())
+        {
+            release_buffer(in);
+        }
+        return;
+    }
+    capture_frames(fd, old_size);
+    dispatch_frames(fd);
+}
 
-    fd_set read_fds;
+#ifndef WHATSAPP_SERVER_NO_MAIN
+/**
+ * Parses a non-negative number option.
+ * @param text The options value.
+ * @param value Set to the number.
+ * @return True if the value is a number, False otherwise.
+ */
+bool parse_number(const char *text, long &value)
+{
+    char *end;
+    errno = 0;
+    value = strtol(text, &end, 10);
+    return errno == 0 && end != text && *end == '\0' && value >= 0 && value <= INT_MAX;
+}
 
-    while (true)
+/**
+ * Parses the options that follow the port number into the configuration.
+ * @return True if the options are valid, False otherwise.
+ */
+bool parse_options(int argc, char *argv[])
+{
+    long value;
+    for (int i = 2; i < argc; ++i)
     {
-        FD_ZERO(&read_fds);
-        FD_SET(s, &read_fds);
-        FD_SET(STDIN_FILENO, &read_fds);
-        for (int fd: connected_fds)
+        std::string option(argv[i]);
+        if (option == "--no-nodelay")
         {
-            FD_SET(fd, &read_fds);
+            config.nodelay = false;
+            continue;
         }
-        int max = 0;
-        if (connected_fds.size() != 0)
+        if (option == "--no-local")
         {
-            max = *(std::max_element(connected_fds.begin(),connected_fds.end()));
+            config.local = false;
+            continue;
         }
-        max = std::max(std::max(max,s),STDIN_FILENO);
-        if (select(max + 1, &read_fds, NULL, NULL, NULL) < 0)
+        if (i + 1 == argc)
         {
-            std::cerr<<"ERROR: select "<<errno<<"."<<std::endl;
-            exit(1);
+            return false;
         }
-
-        if (FD_ISSET(STDIN_FILENO, &read_fds))
+        const char *argument = argv[++i];
+        if (option == "--capture")
         {
-            std::string message;
-            message.clear();
-            std::getline(std::cin,message);
-            if (message == "EXIT")
-            {
-                server_shutdown(s);
-            }
-            else
+            capture_open(argument);
+        }
+        else if (option == "--bind")
+        {
+            if (inet_pton(AF_INET, argument, &config.bind_address) != 1)
             {
-                std::cerr<<"ERROR: invalid input."<<std::endl;
+                return false;
             }
         }
+        else if (option == "--backlog" && parse_number(argument, value) && value > 0)
+        {
+            config.backlog = (int)value;
+        }
+        else if (option == "--max-pending" && parse_number(argument, value) && value > 0)
+        {
+            config.max_pending = (size_t)value;
+        }
+        else if (option == "--defer-accept" && parse_number(argument, value))
+        {
+            config.defer_accept = (int)value;
+        }
+        else if (option == "--slow-timeout" && parse_number(argument, value) && value > 0)
+        {
+            config.slow_timeout = (int)value;
+        }
+        else if (option == "--register-timeout" && parse_number(argument, value) && value > 0)
+        {
+            config.register_timeout = (int)value;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * The main function that boots the program and the loop running as long as the server is up
+ * listening
+ */
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || !parse_options(argc, argv))
+    {
+        std::cerr << "USAGE: whatsappServer portNum [--capture captureFile] [--bind address] "
+                     "[--backlog n] [--max-pending n] [--defer-accept seconds] "
+                     "[--slow-timeout seconds] [--register-timeout seconds] [--no-nodelay] "
+                     "[--no-local]"
+                  << std::endl;
+        exit(1);
+    }
+    // A client that disconnects before reading its reply must fail the write, not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+    // Every client is an fd, the default soft limit would cap the server at about a thousand.
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    name_to_fd.clear();
+    group_to_clients.clear();
+    connected_fds.clear();
 
-        if (FD_ISSET(s, &read_fds))
+    int s = server_boot((uint16_t) atoi(argv[1]));
+    if (config.local && config.bind_address.s_addr == INADDR_ANY)
+    {
+        local_socket = local_boot((uint16_t) atoi(argv[1]));
+    }
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        std::cerr<<"ERROR: epoll_create1 "<<errno<<"."<<std::endl;
+        exit(1);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = STDIN_FILENO;
+    // A stdin that is a regular file cannot be polled, the server then runs without commands.
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0 && errno != EPERM)
+    {
+        std::cerr<<"ERROR: epoll_ctl "<<errno<<"."<<std::endl;
+        exit(1);
+    }
+    // SIGINT and SIGTERM are read in the loop, so the server shuts down like on EXIT and does not
+    // lose the tail of the capture.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    event.events = EPOLLIN;
+    event.data.fd = signal_fd;
+    if (signal_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) < 0)
+    {
+        std::cerr<<"ERROR: signalfd "<<errno<<"."<<std::endl;
+        exit(1);
+    }
+    std::vector<int> welcome_sockets = {s, local_socket};
+    bool listening = false;
+    update_listeners(welcome_sockets, listening);
+
+    struct epoll_event events[MAX_EVENTS];
+    std::vector<int> updated_fds;
+    std::vector<std::coroutine_handle<>> resumed_handlers;
+
+    while (true)
+    {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, next_deadline(monotonic_ms()));
+        if (count < 0)
         {
-            if ((t = accept(s, NULL, NULL)) < 0)
+            if (errno == EINTR)
             {
-                std::cerr<<"ERROR: accept "<<errno<<"."<<std::endl;
-                exit(1);
+                continue;
             }
-            connected_fds.push_back(t);
+            std::cerr<<"ERROR: epoll_wait "<<errno<<"."<<std::endl;
+            exit(1);
         }
 
-        for (int fd : connected_fds)
+        for (int i = 0; i < count; ++i)
         {
-            if (FD_ISSET(fd, &read_fds))
+            int fd = events[i].data.fd;
+            uint32_t ready = events[i].events;
+            if (fd == STDIN_FILENO)
             {
-                size_t message_length = get_message_length(fd);
-                if (message_length == 0)
+                std::string message;
+                message.clear();
+                if (!std::getline(std::cin,message))
                 {
-                    client_exit_request(fd, false);
-                    continue;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
                 }
-                size_t current_message_length = message_length;
-                char buf[current_message_length];
-                char *temp = buf;
-                ssize_t amount = 0;
-                while ((amount = read(fd,temp,current_message_length))>0)
+                else if (message == "EXIT")
                 {
-                    current_message_length -= amount;
-                    temp += amount;
+                    std::cout << "EXIT command is typed: server is shutting down" << std::endl;
+                    server_shutdown(s);
                 }
-                if (amount == -1)
+                else if (message == "MEMORY")
                 {
-                    std::cerr<<"ERROR: read "<<errno<<"."<<std::endl;
-                    client_exit_request(fd, false);
+                    print_memory_usage();
                 }
-                std::deque<std::string> message = split(std::string(buf,message_length), " ");
-                if (message.front() == "create_client")
+                else
                 {
-                    message.pop_front();
-                    create_client(fd,message.front());
+                    std::cerr<<"ERROR: invalid input."<<std::endl;
                 }
-                else
+            }
+            else if (fd == signal_fd)
+            {
+                struct signalfd_siginfo info;
+                if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+                {
+                    std::cout << strsignal((int)info.ssi_signo)
+                              << " received: server is shutting down" << std::endl;
+                    server_shutdown(s);
+                }
+            }
+            else if (fd == s || fd == local_socket)
+            {
+                accept_connections(fd, fd == s);
+            }
+            else
+            {
+                // The events of a connection that closed while this batch was handled are stale,
+                // at worst its fd was reused and the new connection gets an EAGAIN.
+                if (connections[fd].open && (ready & (EPOLLOUT | EPOLLERR | EPOLLHUP)) &&
+                    connections[fd].out_begin < connections[fd].out.size())
                 {
-                    if (fd_to_name.find(fd) == fd_to_name.end())
-                    {
-                        std::string message_to_user("2");
-                        write_wrapper(fd, message_to_user);
-                    }
-                    else if (message.front() == "create_group")
-                    {
-                        message.pop_front();
-                        std::string group_name = message.front();
-                        message.pop_front();
-                        create_group(fd, group_name, split(message.front(), ","));
-                    }
-                    else if (message.front() == "who")
-                    {
-                        who_request(fd);
-                    }
-                    else if (message.front() == "exit")
-                    {
-                        client_exit_request(fd, true);
-                    }
-                    else if (message.front() == "send")
-                    {
-                        message.pop_front();
-                        std::string receiver_name = message.front();
-                        message.pop_front();
-                        std::string the_message("");
-                        while (!message.empty())
-                        {
-                            the_message += message.front();
-                            the_message += " ";
-                            message.pop_front();
-                        }
-                        the_message.pop_back();
-                        if (name_to_fd.find(receiver_name) != name_to_fd.end())
-                        {
-                            send_message_request(fd,name_to_fd[receiver_name],
-                                                 the_message,true);
-                        }
-                        else if (group_to_clients.find(receiver_name) !=
-                                group_to_clients.end() && group_to_clients[receiver_name].find
-                                (fd) != group_to_clients[receiver_name].end())
-                        {
-                            send_group_message_request(fd,receiver_name,
-                                                       group_to_clients[receiver_name], the_message);
-                        }
-                        else
-                        {
-                            std::string message_to_user("ERROR: failed to send.");
-                            std::cerr<< fd_to_name[fd]<<": ERROR: failed to send "
-                                    "\""<<the_message<<"\" to "<<receiver_name<<"."<<std::endl;
-                            write_wrapper(fd, message_to_user);
-                        }
-                    }
+                    flush_connection(fd);
                 }
+                if (connections[fd].open && connections[fd].busy &&
+                    (ready & (EPOLLRDHUP | EPOLLERR | EPOLLHUP)))
+                {
+                    // A busy client is only watched for the hangup, his request is abandoned.
+                    client_exit_request(fd, false);
+                }
+                if (connections[fd].open && (ready & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+                    !connections[fd].closing)
+                {
+                    read_connection(fd);
+                }
+            }
+        }
+        expire_deadlines(monotonic_ms());
+
+        while (!ready_handlers.empty())
+        {
+            resumed_handlers.clear();
+            resumed_handlers.swap(ready_handlers);
+            for (std::coroutine_handle<> handler : resumed_handlers)
+            {
+                handler.resume();
             }
         }
+
+        updated_fds.clear();
+        updated_fds.swap(dirty_fds);
+        for (int fd : updated_fds)
+        {
+            update_events(fd);
+        }
+        update_listeners(welcome_sockets, listening);
+        if (!capture_buffer.empty())
+        {
+            capture_flush();
+        }
     }
-}
\ No newline at end of file
+}
+#endif
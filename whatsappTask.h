@@ -0,0 +1,283 @@
+#ifndef WHATSAPP_TASK_H
+#define WHATSAPP_TASK_H
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * A minimal coroutine runtime for the servers request handlers. A Task is a lazily started
+ * coroutine that runs when it is awaited and resumes its awaiter when it finishes. spawn starts a
+ * Task that nobody awaits, its frame is freed when it finishes. Coroutine frames come from a
+ * per-thread arena so a request does not cost a heap allocation once the arena is warm.
+ *
+ * The runtime does not know about sockets, the awaitables that suspend a handler until an event
+ * happens are defined by the event loop that resumes them.
+ */
+namespace whatsapp
+{
+
+/**
+ * A per-thread allocator for coroutine frames. Frames are rounded up to a multiple of
+ * GRANULARITY and kept on a free list per size after they are freed. Frames larger than
+ * MAX_FRAME go to the global allocator.
+ */
+class FrameArena
+{
+public:
+    static const size_t GRANULARITY = 64;
+    static const size_t MAX_FRAME = 4096;
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    static void *allocate(size_t size)
+    {
+        if (size > MAX_FRAME)
+        {
+            return ::operator new(size);
+        }
+        FrameArena &arena = instance();
+        size_t index = (size + GRANULARITY - 1) / GRANULARITY;
+        FreeBlock *block = arena.free_lists[index];
+        if (block != nullptr)
+        {
+            arena.free_lists[index] = block->next;
+            return block;
+        }
+        size_t rounded = index * GRANULARITY;
+        if (arena.chunk_left < rounded)
+        {
+            arena.chunks.push_back(static_cast<char *>(::operator new(CHUNK_SIZE)));
+            arena.chunk_next = arena.chunks.back();
+            arena.chunk_left = CHUNK_SIZE;
+        }
+        void *frame = arena.chunk_next;
+        arena.chunk_next += rounded;
+        arena.chunk_left -= rounded;
+        return frame;
+    }
+
+    static void deallocate(void *frame, size_t size)
+    {
+        if (size > MAX_FRAME)
+        {
+            ::operator delete(frame);
+            return;
+        }
+        FrameArena &arena = instance();
+        size_t index = (size + GRANULARITY - 1) / GRANULARITY;
+        FreeBlock *block = static_cast<FreeBlock *>(frame);
+        block->next = arena.free_lists[index];
+        arena.free_lists[index] = block;
+    }
+
+    ~FrameArena()
+    {
+        for (char *chunk : chunks)
+        {
+            ::operator delete(chunk);
+        }
+    }
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    FrameArena() : free_lists(), chunk_next(nullptr), chunk_left(0)
+    {
+    }
+
+    static FrameArena &instance()
+    {
+        static thread_local FrameArena arena;
+        return arena;
+    }
+
+    FreeBlock *free_lists[MAX_FRAME / GRANULARITY + 1];
+    std::vector<char *> chunks;
+    char *chunk_next;
+    size_t chunk_left;
+};
+
+template <typename T = void>
+class Task;
+
+namespace detail
+{
+
+/**
+ * The parts of a promise that do not depend on the result type.
+ */
+struct PromiseBase
+{
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            PromiseBase &promise = handle.promise();
+            if (promise.continuation)
+            {
+                return promise.continuation;
+            }
+            if (promise.detached)
+            {
+                handle.destroy();
+            }
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    FinalAwaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception() noexcept
+    {
+        std::terminate();
+    }
+
+    static void *operator new(size_t size)
+    {
+        return FrameArena::allocate(size);
+    }
+
+    static void operator delete(void *frame, size_t size)
+    {
+        FrameArena::deallocate(frame, size);
+    }
+
+    std::coroutine_handle<> continuation;
+    bool detached = false;
+};
+
+template <typename T>
+struct Promise : PromiseBase
+{
+    Task<T> get_return_object() noexcept;
+
+    void return_value(T result) noexcept
+    {
+        value = std::move(result);
+    }
+
+    T value{};
+};
+
+template <>
+struct Promise<void> : PromiseBase
+{
+    Task<void> get_return_object() noexcept;
+
+    void return_void() noexcept
+    {
+    }
+};
+
+}
+
+/**
+ * A coroutine that produces a T. It starts when it is awaited and the awaiter is resumed with
+ * its result once it finishes.
+ */
+template <typename T>
+class Task
+{
+public:
+    typedef detail::Promise<T> promise_type;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle)
+    {
+    }
+
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr))
+    {
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task()
+    {
+        if (handle)
+        {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+
+    T await_resume() noexcept
+    {
+        if constexpr (!std::is_void<T>::value)
+        {
+            return std::move(handle.promise().value);
+        }
+    }
+
+private:
+    friend void spawn(Task<void> task);
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail
+{
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() noexcept
+{
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept
+{
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+}
+
+/**
+ * Starts a task that nobody awaits. It runs until its first suspension before spawn returns
+ * and frees itself when it finishes.
+ * @param task The task to start.
+ */
+inline void spawn(Task<void> task)
+{
+    std::coroutine_handle<detail::Promise<void>> handle = std::exchange(task.handle, nullptr);
+    handle.promise().detached = true;
+    handle.resume();
+}
+
+}
+
+#endif